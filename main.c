@@ -1,684 +1,5231 @@
-/* 
- * File:   main.c
- * Author: David
- *
- * Created on October 2, 2016, 10:45 PM
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <math.h>
-#include <string.h>
-#include <ctype.h>
-
-//Structures
-typedef struct {
-  int kind; // 0 = cylinder, 1 = sphere
-  double color[3];
-  double center[3];
-  union {
-    struct {
-      double normal[3];
-      double difuse_color[3];
-      double specular_color[3];      
-    } plane;
-    struct {
-      double radius;
-      double difuse_color[3];
-      double specular_color[3];
-    } sphere;
-    struct {
-      double height;
-      double width;
-    } camera;
-    struct{
-        double radial2;
-        double radial1;
-        double radial0;
-        double angular0;
-        double direction[3];
-        double theta;
-    } light;
-  };
-} Object;
-typedef struct{
-    char r;
-    char g;
-    char b;
-    } Pixel;
-    
-    //Global Variables
-    double h = 0.7;
-    double w = 0.7;
-    int line = 1;
-    Pixel* image;
-    Object** objects;
-    Object** lights;
-    #define MAXCOLOR 255 
-    void set_camera(FILE* json);
-    Object camera;
-    //sqr function
-static inline double sqr(double v) {
-  return v*v;
-}
-
-//normalize function
-static inline void normalize(double* v) {
-  double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
-  v[0] /= len;
-  v[1] /= len;
-  v[2] /= len;
-}
-
-//checks for sphere intersection
-double sphere_intersection(double* Ro, double* Rd,
-			     double* C, double r) {
-
-  double a = sqr(Rd[0]) + sqr(Rd[2]) + sqr(Rd[1]);
-  double b = (2 * (Rd[0] * (Ro[0] - C[0]) + Rd[2] * (Ro[2] - C[2]) + Rd[1] * (Ro[1] - C[1])));
-  double c = sqr(Ro[0]-C[0]) + sqr(Ro[2]-C[2]) + sqr(Ro[1]-C[1]) - sqr(r);
-
-  double det = sqr(b) - 4 * a * c;
-  if (det < 0) 
-      return -1;
-
-  det = sqrt(det);
-  
-  double t0 = (-b - det) / (2*a);
-  if (t0 > 0) 
-      return t0;
-
-  double t1 = (-b + det) / (2*a);
-  if (t1 > 0) 
-      return t1;
-
-  return -1;
-}
-
-//checks for plane intersection
-double plane_intersection(double* Ro, double* Rd, double* C, double* normal){
-    double d = normal[0]*C[0] + normal[1]*C[1] + normal[2]*C[2];
-    double t = -(normal[0]*Ro[0] + normal[1]*Ro[1] + normal[2]*Ro[2] + d)/(normal[0]*Rd[0] + normal[1]*Rd[1] + normal[2]*Rd[2]);
-    if (t > 0){
-        return t;
-    }else{
-        return -1;
-    }
-}
-
-// next_c() wraps the getc() function and provides error checking and line
-// number maintenance
-int next_c(FILE* json) {
-  int c = fgetc(json);
-
-  if (c == '\n') {
-    line += 1;
-  }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
-  }
-  return c;
-}
-
-
-char* next_string(FILE* json) {
-  char buffer[129];
-  int c = next_c(json);
-  if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
-    exit(1);
-  }  
-  c = next_c(json);
-  int i = 0;
-  while (c != '"') {
-    if (i >= 128) {
-      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-      exit(1);      
-    }
-    if (c == '\\') {
-      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-      exit(1);      
-    }
-    if (c < 32 || c > 126) {
-      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-      exit(1);
-    }
-    buffer[i] = c;
-    i += 1;
-    c = next_c(json);
-  }
-  buffer[i] = 0;
-  return strdup(buffer);
-}
-
-// expect_c() checks that the next character is d.  If it is not it emits
-// an error.
-void expect_c(FILE* json, int d) {
-  int c = next_c(json);
-  if (c == d) return;
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-  exit(1);    
-}
-
-
-// skip_ws() skips white space in the file.
-void skip_ws(FILE* json) {
-  int c = next_c(json);
-  while (isspace(c)) {
-    c = next_c(json);
-  }
-  ungetc(c, json);
-}
-
-
-// next_string() gets the next string from the file handle and emits an error
-// if a string can not be obtained.
-
-
-double next_number(FILE* json) {
-  double value;
-  if (fscanf(json, "%lf", &value) != 1){
-      fprintf(stderr,"Number value not found on line %d.", line);
-      return -1;
-  }
-  return value;
-}
-
-double* next_vector(FILE* json) {
-  double* v = malloc(3*sizeof(double));
-  expect_c(json, '[');
-  skip_ws(json);
-  v[0] = next_number(json);
-  skip_ws(json);
-  expect_c(json, ',');
-  skip_ws(json);
-  v[1] = next_number(json);
-  skip_ws(json);
-  expect_c(json, ',');
-  skip_ws(json);
-  v[2] = next_number(json);
-  skip_ws(json);
-  expect_c(json, ']');
-  return v;
-}
-
-//begins the parsing of the file
-void read_scene(char* filename) {
-  int c;
-  FILE* json = fopen(filename, "r");
-  if (json == NULL) {
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-    exit(1);
-  }
-  
-  skip_ws(json);
-  
-  // Find the beginning of the list
-  expect_c(json, '[');
-  skip_ws(json);
-
-  // Find the objects
-  int i = 0;
-  int j = 0;
-  while (1) {
-    c = fgetc(json);
-    if (c == ']') {
-      fprintf(stderr, "Error: This is the worst scene file EVER.\n");
-      fclose(json);
-      return;
-    }
-    if (c == '{') {
-        objects[i] = malloc(sizeof(Object));
-        lights[i] = malloc(sizeof(Object));
-      skip_ws(json);
-    
-      // Parse the object
-      char* key = next_string(json);
-      if (strcmp(key, "type") != 0) {
-	fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-	exit(1);
-      }
-
-      skip_ws(json);
-
-      expect_c(json, ':');
-
-      skip_ws(json);
-
-      char* value = next_string(json);
-      
-      //Sets value of the object or arranges the camera
-      if (strcmp(value, "camera") == 0) {
-          set_camera(json);
-      } else if (strcmp(value, "sphere") == 0) {
-          
-          objects[i]->kind = 1;
-          
-      } else if (strcmp(value, "plane") == 0) {
-          
-          objects[i]->kind = 0;
-          
-      }else if(strcmp(value, "light") == 0){
-  
-          lights[j]->kind = 2;
-          
-      } else {
-	fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-	exit(1);
-      }
-
-      skip_ws(json);
-      //Makes sure we skip the object if it is the camera because of the function set_camera
-      if (strcmp(value, "camera") != 0){
-        while (1) {
-          // , }
-          c = next_c(json);
-
-          if (c == '}') {
-            // stop parsing this object
-            break;
-          } else if (c == ',') {
-              
-            // read another field
-            skip_ws(json);
-            char* key = next_string(json);
-            skip_ws(json);
-            expect_c(json, ':');
-            skip_ws(json);
-            
-            //sets radius
-            if (strcmp(key, "radius") == 0) {
-              double value = next_number(json);
-               if(objects[i]->kind == 1){
-                  objects[i]->sphere.radius = value;
-              }else{
-                   fprintf(stderr, "Radius should only to attached to a sphere.");
-              }
-              //Checks for position,color, and normal fields
-            } else if ((strcmp(key, "color") == 0) ||
-                       (strcmp(key, "position") == 0) ||
-                       (strcmp(key, "normal") == 0) ||
-                       (strcmp(key, "diffuse_color") == 0)||
-                       (strcmp(key, "specular_color") == 0)||
-                       (strcmp(key, "direction") == 0)) {
-              double* value = next_vector(json);
-              
-              //sets position and color for sphere
-              if(objects[i]->kind == 1){
-                  if(strcmp(key, "position") == 0){
-                      objects[i]->center[0] = value[0];
-                      objects[i]->center[1] = -value[1];
-                      objects[i]->center[2] = value[2];
-                  
-                  }else if(strcmp(key, "color") == 0){
-                      objects[i]->color[0] = value[0];
-                      objects[i]->color[1] = value[1];
-                      objects[i]->color[2] = value[2];
-                  }else if(strcmp(key, "diffuse_color") == 0){
-                      objects[i]->sphere.difuse_color[0] = value[0];
-                      objects[i]->sphere.difuse_color[1] = value[1];
-                      objects[i]->sphere.difuse_color[2] = value[2];
-                  }else if(strcmp(key, "specular_color") == 0){
-                      objects[i]->sphere.specular_color[0] = value[0];
-                      objects[i]->sphere.specular_color[1] = value[1];
-                      objects[i]->sphere.specular_color[2] = value[2];
-                  }else{
-                      fprintf(stderr, "Non-valid field entered for a sphere");
-                      exit(1);
-                 }
-                  //sets position and color for plane
-              }else if(objects[i]->kind == 0){
-                  if(strcmp(key, "position") == 0){
-                      objects[i]->center[0] = value[0];
-                      objects[i]->center[1] = value[1];
-                      objects[i]->center[2] = value[2];
-                  }else if(strcmp(key, "color") == 0){
-                      objects[i]->color[0] = value[0];
-                      objects[i]->color[1] = value[1];
-                      objects[i]->color[2] = value[2];
-                  }else if(strcmp(key,"normal") == 0) {
-                      objects[i]->plane.normal[0] = value[0];
-                      objects[i]->plane.normal[1] = value[1];
-                      objects[i]->plane.normal[2] = value[2];
-                  }else if(strcmp(key, "diffuse_color") == 0){
-                      objects[i]->plane.difuse_color[0] = value[0];
-                      objects[i]->plane.difuse_color[1] = value[1];
-                      objects[i]->plane.difuse_color[2] = value[2];
-                  }else if(strcmp(key, "specular_color") == 0){
-                      objects[i]->plane.specular_color[0] = value[0];
-                      objects[i]->plane.specular_color[1] = value[1];
-                      objects[i]->plane.specular_color[2] = value[2];
-                  }else{
-                      fprintf(stderr, "Non-valid field entered for a plane");
-                      exit(1);
-                 }
-              }else if(lights[j]->kind == 2){
-                  if(strcmp(key, "position") == 0){
-                      lights[j]->center[0] = value[0];
-                      lights[j]->center[1] = value[1];
-                      lights[j]->center[2] = value[2];
-                  }else if(strcmp(key, "color") == 0){
-                      lights[j]->color[0] = value[0];
-                      lights[j]->color[1] = value[1];
-                      lights[j]->color[2] = value[2];
-                  }else if(strcmp(key,"direction") == 0) {
-                      lights[j]->light.direction[0] = value[0];
-                      lights[j]->light.direction[1] = value[1];
-                      lights[j]->light.direction[2] = value[2];
-                  }else{
-                      fprintf(stderr, "Non-valid field entered for a plane");
-                      exit(1);
-                 }
-              }
-
-            } else if ((strcmp(key, "radial-a2") == 0) ||
-                       (strcmp(key, "radial-a1") == 0) ||
-                       (strcmp(key, "radial-a0") == 0) ||
-                       (strcmp(key, "angular-a0") == 0) ||
-                       (strcmp(key, "theta") == 0)) {
-                double value = next_number(json);
-                  if(lights[j]->kind == 2){
-                      if(strcmp(key, "radial-a2") == 0){
-                          lights[j]->light.radial2 = value;
-                      }else if (strcmp(key, "radial-a1") == 0){
-                          lights[j]->light.radial1 = value;
-                      }else if (strcmp(key, "radial-a0") == 0){
-                          lights[j]->light.radial0 = value;
-                      }else if (strcmp(key, "angular-a0") == 0){
-                          lights[j]->light.angular0 = value;
-                      }else if(strcmp(key,"theta") == 0) {
-                          lights[j]->light.theta = value;
-                      }
-                  }     
-            } else {
-              fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                      key, line);
-              //char* value = next_string(json);
-            }
-            skip_ws(json);
-          } else {
-            fprintf(stderr, "Error: Unexpected value on line %d\n", line);
-            exit(1);
-          }
-        }
-      i++;
-      j++;
-      }
-      
-      skip_ws(json);
-      c = next_c(json);
-      if (c == ',') {
-	// noop
-	skip_ws(json);
-      } else if (c == ']') {
-          objects[i] = NULL;
-          lights[i] = NULL;
-	fclose(json);
-	return;
-      } else {
-	fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
-	exit(1);
-      }
-    }
-  }
-  
-}
-
-double static clamp(double s){
- if(s > 1){
-     return 1;
- }else if (s < 0){
-     return s;
- }else{
-     return s;
- }
-}
-
-int main(int argc, char** argv) {
-    objects = malloc(sizeof(Object*)*129);
-    lights = malloc(sizeof(Object*)*129);
-    int index = 0;
-    FILE* outputfile;
-    //checks for number of arguments
-    if(argc != 5){
-        fprintf(stderr, "Please put the commands in the following format: height, weight, source file, destination file.");
-        exit(1);
-    }
-    read_scene(argv[3]);
-    Object* object;
-  
-  double cx = camera.center[0];
-  double cy = camera.center[1];
-  double cz = camera.center[2];
-//grabs height and width of pixel
-  int M = atoi(argv[2]);
-  int N = atoi(argv[1]);
-  if(M <= 0 || N <= 0){
-      fprintf(stderr, "Please make Height and Width a positive integer.");
-      exit(1);
-  }
-  image = malloc(sizeof(Pixel)*M*N);
-  double pixheight = camera.camera.height / M;
-  double pixwidth = camera.camera.width / N;
-  
-  //Set the objects into the proper place and set the image pixels
-  for (int y = 0; y < M; y += 1) {
-      for (int x = 0; x < N; x += 1) {
-        double Ro[3] = {cx, cy, cz};
-        // Rd = normalize(P - Ro)
-        double Rd[3] = {
-          cx - (camera.camera.width/2) + pixwidth * (x + 0.5),
-          cy - (camera.camera.height/2) + pixheight * (y + 0.5),
-          1
-        };
-
-        normalize(Rd);
-        double best_t = INFINITY;
-        Object* object2;
-        for (int i=0; objects[i] != 0; i += 1) {
-            double t = 0;
-            switch(objects[i]->kind) {
-              case 0:
-                  t = plane_intersection(Ro, Rd,objects[i]->center, objects[i]->plane.normal);
-                  break;
-
-              case 1:
-                  t = sphere_intersection(Ro, Rd,objects[i]->center, objects[i]->sphere.radius);
-                  break;
-
-              default:
-            // Horrible error
-                  exit(1);
-          }
-          
-          if (t > 0 && t < best_t){
-              best_t = t;
-              object2 = object;
-              object = malloc(sizeof(Object));
-              memcpy(object, objects[i], sizeof(Object));
-          } 
-        }
-            //set the color for the pixel
-        if (best_t > 0 && best_t != INFINITY) {
-            double color[3];
-            color[0] = 0;
-            color[1] = 0;
-            color[2] = 0;
-            double object_position[3];
-            double Pixel_position[3];
-            double N[3];
-            Pixel_position[0] = Rd[0] * best_t + Ro[0];
-            object_position[0] = camera.center[0] - Pixel_position[0];
-            Pixel_position[1] = Rd[1] * best_t + Ro[1];
-            object_position[1] = camera.center[1] - Pixel_position[1];
-            Pixel_position[2] = Rd[2] * best_t + Ro[2];
-            object_position[2] = camera.center[2] - Pixel_position[2];
-            normalize(object_position);
-            if (object->kind == 1){
-                N[0] = Pixel_position[0] - object2->center[0];
-                N[1] = Pixel_position[1] - object2->center[1];
-                N[2] = Pixel_position[2] - object2->center[2];
-            }else if (object->kind == 2){
-                N[0] = object2->plane.normal[0];
-                N[1] = object2->plane.normal[1];
-                N[2] = object2->plane.normal[2];
-            }
-            normalize(N);
-            for(int j = 0; lights[j] != NULL; j += 1){
-                double light_object[3];
-                double object_light[3];
-                object_light[0] = lights[j]->center[0] - Pixel_position[0];
-                object_light[1] = lights[j]->center[1] - Pixel_position[1];
-                object_light[2] = lights[j]->center[2] - Pixel_position[2];
-                light_object[0] = Rd[0] * best_t + Ro[0];
-                light_object[1] = Rd[1] * best_t + Ro[1];
-                light_object[2] = Rd[2] * best_t + Ro[2];
-                normalize(light_object);
-                normalize(object_light);
-                double shadow = 0;
-                double dl = sqrt(sqr(Pixel_position[0] - lights[j]->center[0])
-                + sqr(Pixel_position[1] - lights[j]->center[1]) 
-                + sqr(Pixel_position[2] - lights[j]->center[2]));
-                Object* current_object;
-                for(int k = 0; objects[k] != NULL; k += 1){
-                    current_object = objects[k];
-                    if(current_object == object2){
-                        continue;
-                    }
-                    double new_t = 0;
-                    switch(objects[k]->kind) {
-                        case 0:
-                            new_t = plane_intersection(Pixel_position, object_light,
-                                    objects[k]->center, objects[k]->plane.normal);
-                            break;
-
-                        case 1:
-                            new_t = sphere_intersection(Pixel_position, object_light,
-                                    objects[k]->center, objects[k]->sphere.radius);
-                            break;
-                        default:
-                      // Horrible error
-                            exit(1);
-                    }
-                    if(new_t > 0 && new_t <= dl){
-                        shadow = 1;
-                        break;
-                    }
-                }
-                if (shadow == 0){
-                    double diffuse[3];
-                    double fang;
-                    double specular[3];
-                    double frad =(1/(lights[j]->light.radial2*sqr(dl) + lights[j]->light.radial1*dl + lights[j]->light.radial0*dl));
-                    double R[3];
-                    double L[3];
-                    L[0] = lights[j]->light.direction[0];
-                    L[1] = lights[j]->light.direction[1];
-                    L[2] = lights[j]->light.direction[2];
-                    double alpha = L[0] * lights[j]->center[0] 
-                    + L[1] * lights[j]->center[1] 
-                    + L[2] * lights[j]->center[2];
-                    if (lights[j]->light.theta == 0){
-                        fang = 1;
-                    }else if (cos(lights[j]->light.theta) > cos(alpha)){
-                        fang = 0;
-                    }else{
-                        fang = pow(cos(alpha),20);
-                    }
-                    if (object->kind == 1){
-                        diffuse[0] = object2->sphere.difuse_color[0];
-                        diffuse[1] = object2->sphere.difuse_color[1];
-                        diffuse[2] = object2->sphere.difuse_color[2];
-                        specular[0] = object2->sphere.specular_color[0];
-                        specular[1] = object2->sphere.specular_color[1];
-                        specular[2] = object2->sphere.specular_color[2];
-                    }else if (object->kind == 0){
-                        diffuse[0] = object2->plane.difuse_color[0];
-                        diffuse[1] = object2->plane.difuse_color[1];
-                        diffuse[2] = object2->plane.difuse_color[2];
-                        specular[0] = object2->plane.specular_color[0];
-                        specular[1] = object2->plane.specular_color[1];
-                        specular[2] = object2->plane.specular_color[2];
-                    }else{
-                        fprintf(stderr, "Type of object does not exist");
-                    }
-                    
-                    R[0] = light_object[0] - 2 * (N[0] * light_object[0] + N[1] * light_object[1] + N[2] * light_object[2]) * N[0];
-                    R[1] = light_object[1] - 2 * (N[0] * light_object[0] + N[1] * light_object[1] + N[2] * light_object[2]) * N[1];
-                    R[2] = light_object[2] - 2 * (N[0] * L[0] + N[1] * L[1] + N[2] * L[2]) * N[2];
-                    normalize(R);
-                    normalize(L);
-                    double difuse = (N[0] * object_light[0] + N[1] * object_light[1] + N[2] * object_light[2]);
-                    double specular2 = (R[0] * object_position[0] + R[1] * object_position[1] + object_position[2] * R[2]);
-                    if(difuse <= 0){
-                        difuse = 0;
-                    }
-                    if (specular2 <= 0 && difuse <= 0){
-                        specular2 = 0;
-                    }
-                    double specular3 = pow(specular2, 20);
-                    color[0] += frad*fang*((lights[j]->color[0]*difuse*diffuse[0]) + (lights[j]->color[0] * specular3 * specular[0]));
-                    color[1] += frad*fang*((lights[j]->color[1]*difuse*diffuse[1]) + (lights[j]->color[1] * specular3 * specular[1]));
-                    color[2] += frad*fang*((lights[j]->color[2]*difuse*diffuse[2]) + (lights[j]->color[2] * specular3 * specular[2]));
-                }
-            }
-            image[index].r = (unsigned char)(clamp(color[0])*MAXCOLOR);
-            image[index].g = (unsigned char)(clamp(color[1])*MAXCOLOR);
-            image[index].b = (unsigned char)(clamp(color[2])*MAXCOLOR);
-        }else{
-            image[index].r = 255;
-            image[index].g = 255;
-            image[index].b = 255;
-        }
-        index++;
-        }
-    }
-        
-        
-  //output to file
-  outputfile = fopen(argv[4], "w");
-  fprintf(outputfile, "P6\n");
-  fprintf(outputfile, "%d %d\n", M, N);
-  fprintf(outputfile, "%d\n", MAXCOLOR);
-  fwrite(image, sizeof(Pixel), M*N, outputfile);
-  return 0;
-}
-//set camera view
-void set_camera(FILE* json){
-    int c;
-    skip_ws(json);
-    camera.center[0] = 0;
-    camera.center[1] = 0;
-    camera.center[2] = 0;
-      while (1) {
-	// , }
-	c = next_c(json);
-        
-	if (c == '}') {
-	  // stop parsing this object
-	  break;
-	} else if (c == ',') {
-            
-	  // read another field
-	  skip_ws(json);
-	  char* key = next_string(json);
-	  skip_ws(json);
-	  expect_c(json, ':');
-	  skip_ws(json);
-          double value = next_number(json);
-	  if (strcmp(key, "width") == 0) {
-              camera.camera.width = value;
-            
-	  } else if ((strcmp(key, "height") == 0)) {
-              camera.camera.height = value;
-            
-	  } else {
-	    fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-		    key, line);
-            exit(1);
-	    //char* value = next_string(json);
-	  }
-        }
-      }
-}
+/* 
+ * File:   main.c
+ * Author: David
+ *
+ * Created on October 2, 2016, 10:45 PM
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <tgmath.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//Scalar type of the geometry and shading math. make PRECISION=float builds
+//with float, which puts twice as many lanes in every SIMD vector and halves
+//the scene's memory traffic. RAY_EPSILON is the shadow ray offset relative
+//to the size of the scene, sized to the rounding error of the type.
+#ifdef RAYCAST_FLOAT
+typedef float real;
+#define RAY_EPSILON 1e-5
+#else
+typedef double real;
+#define RAY_EPSILON 1e-12
+#endif
+
+//reals per AVX vector; the packed stores, kernels and BVH leaves work in
+//runs of this many
+#define SIMD_WIDTH (32 / (int)sizeof(real))
+
+//Structures
+typedef struct {
+  int kind; // 0 = cylinder, 1 = sphere
+  real color[3];
+  real center[3];
+  union {
+    struct {
+      real normal[3];
+      real difuse_color[3];
+      real specular_color[3];      
+    } plane;
+    struct {
+      real radius;
+      real difuse_color[3];
+      real specular_color[3];
+    } sphere;
+    struct {
+      real height;
+      real width;
+    } camera;
+    struct{
+        real radial2;
+        real radial1;
+        real radial0;
+        real angular0;
+        real direction[3];
+        real theta;
+    } light;
+  };
+} Object;
+typedef struct{
+    char r;
+    char g;
+    char b;
+    } Pixel;
+    
+    //Global Variables
+    real h = 0.7;
+    real w = 0.7;
+    _Thread_local int line = 1;
+    Pixel* image;
+    float* framebuffer;
+    Object** objects;
+    Object** lights;
+    int object_count;
+    int light_count;
+    #define MAXCOLOR 255 
+    #define TILE_SIZE 32
+    //worker handles live in fixed arrays of this size on the caller's stack
+    #define MAX_THREADS 256
+    int image_width;
+    int image_height;
+    int image_rows;
+    real pixwidth;
+    real pixheight;
+    int num_threads;
+    int use_packets;
+    int samples_per_pixel = 1;
+    int refine_threshold = 8;
+    atomic_int next_tile;
+    Object camera;
+    //sqr function
+static inline real sqr(real v) {
+  return v*v;
+}
+
+//Hot-path counters, compiled in only with -DRAYCAST_STATS (make STATS=1);
+//otherwise every STAT_ macro expands to nothing. Each thread counts into
+//its own copy, which stats_flush() folds into render_stats.
+typedef struct {
+    uint64_t primary_rays;
+    uint64_t shadow_rays;
+    uint64_t shadow_early_outs;
+    uint64_t shadow_culled;
+    uint64_t occluder_cache_hits;
+    uint64_t sphere_tests;
+    uint64_t plane_tests;
+    uint64_t box_tests;
+    uint64_t grid_cells;
+    uint64_t mailbox_hits;
+    uint64_t reflection_rays;
+    uint64_t reflections_dropped;
+    uint64_t primary_cycles;
+    uint64_t shadow_cycles;
+    uint64_t shade_cycles;
+    uint64_t output_cycles;
+} RenderStats;
+
+RenderStats render_stats;
+
+#ifdef RAYCAST_STATS
+static _Thread_local RenderStats thread_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//cycle counter on x86, nanoseconds elsewhere
+static inline uint64_t stats_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void stats_flush(void) {
+    uint64_t* from = (uint64_t*)&thread_stats;
+    uint64_t* to = (uint64_t*)&render_stats;
+    pthread_mutex_lock(&stats_lock);
+    for (size_t i = 0; i < sizeof(RenderStats) / sizeof(uint64_t); i += 1) {
+        to[i] += from[i];
+    }
+    pthread_mutex_unlock(&stats_lock);
+    memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+#define STAT_ADD(field, n) (thread_stats.field += (n))
+#define STAT_CLOCK() stats_clock()
+#define STAT_FLUSH() stats_flush()
+#else
+#define STAT_ADD(field, n) ((void)sizeof(n))
+#define STAT_CLOCK() 0
+#define STAT_FLUSH() ((void)0)
+#endif
+
+//normalize function
+static inline void normalize(real* v) {
+  real len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+  v[0] /= len;
+  v[1] /= len;
+  v[2] /= len;
+}
+
+//checks for sphere intersection
+real sphere_intersection(real* Ro, real* Rd,
+			     real* C, real r) {
+
+  real a = sqr(Rd[0]) + sqr(Rd[2]) + sqr(Rd[1]);
+  real b = (2 * (Rd[0] * (Ro[0] - C[0]) + Rd[2] * (Ro[2] - C[2]) + Rd[1] * (Ro[1] - C[1])));
+  real c = sqr(Ro[0]-C[0]) + sqr(Ro[2]-C[2]) + sqr(Ro[1]-C[1]) - sqr(r);
+
+  real det = sqr(b) - 4 * a * c;
+  if (det < 0) 
+      return -1;
+
+  det = sqrt(det);
+  
+  real t0 = (-b - det) / (2*a);
+  if (t0 > 0) 
+      return t0;
+
+  real t1 = (-b + det) / (2*a);
+  if (t1 > 0) 
+      return t1;
+
+  return -1;
+}
+
+//checks for plane intersection
+real plane_intersection(real* Ro, real* Rd, real* C, real* normal){
+    real d = normal[0]*C[0] + normal[1]*C[1] + normal[2]*C[2];
+    real t = -(normal[0]*Ro[0] + normal[1]*Ro[1] + normal[2]*Ro[2] + d)/(normal[0]*Rd[0] + normal[1]*Rd[1] + normal[2]*Rd[2]);
+    if (t > 0){
+        return t;
+    }else{
+        return -1;
+    }
+}
+
+//intersects a ray with one scene object, dispatching on its kind
+static inline real object_intersection(Object* object, real* Ro, real* Rd) {
+    switch(object->kind) {
+      case 0:
+          return plane_intersection(Ro, Rd, object->center, object->plane.normal);
+      case 1:
+          return sphere_intersection(Ro, Rd, object->center, object->sphere.radius);
+      default:
+    // Horrible error
+          exit(1);
+    }
+}
+
+//Bounding volume hierarchy over the spheres. Nodes live in one array; an
+//interior node's children sit next to each other at left_first and
+//left_first + 1, a leaf covers count entries of bvh_prims from left_first.
+//Planes are unbounded and are kept in their own short list.
+typedef struct {
+    real min[3];
+    real max[3];
+    int left_first;
+    int count;
+} BVHNode;
+
+#define BVH_BINS 16
+#define BVH_LEAF_SIZE SIMD_WIDTH
+#define BVH_STACK 128
+//every walk pops a node before pushing its two children, so a tree no deeper
+//than this never holds more than BVH_STACK entries on a traversal stack
+#define BVH_MAX_DEPTH (BVH_STACK - 2)
+
+BVHNode* bvh_nodes;
+int bvh_node_count;
+int* bvh_prims;
+int bvh_prim_count;
+int* plane_list;
+int plane_count;
+
+//grows a box to hold the bounds of sphere objects[i]
+static void bvh_grow(real* mn, real* mx, int i) {
+    for (int a = 0; a < 3; a += 1) {
+        real r = objects[i]->sphere.radius;
+        if (objects[i]->center[a] - r < mn[a]) mn[a] = objects[i]->center[a] - r;
+        if (objects[i]->center[a] + r > mx[a]) mx[a] = objects[i]->center[a] + r;
+    }
+}
+
+static real bvh_area(real* mn, real* mx) {
+    real dx = mx[0] - mn[0], dy = mx[1] - mn[1], dz = mx[2] - mn[2];
+    return 2 * (dx*dy + dy*dz + dz*dx);
+}
+
+//fills in node n over bvh_prims[first .. first+count) and splits it where the
+//surface area heuristic says a split is cheaper than a leaf; a node at
+//BVH_MAX_DEPTH stays a leaf however many spheres it holds
+static void bvh_build_node(int n, int first, int count, int depth) {
+    BVHNode* node = &bvh_nodes[n];
+    real cmin[3] = {INFINITY, INFINITY, INFINITY};
+    real cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int a = 0; a < 3; a += 1) {
+        node->min[a] = INFINITY;
+        node->max[a] = -INFINITY;
+    }
+    for (int i = first; i < first + count; i += 1) {
+        bvh_grow(node->min, node->max, bvh_prims[i]);
+        for (int a = 0; a < 3; a += 1) {
+            real c = objects[bvh_prims[i]]->center[a];
+            if (c < cmin[a]) cmin[a] = c;
+            if (c > cmax[a]) cmax[a] = c;
+        }
+    }
+    node->left_first = first;
+    node->count = count;
+    if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH) {
+        return;
+    }
+
+    //binned SAH over every axis
+    real best_cost = count * bvh_area(node->min, node->max);
+    int best_axis = -1;
+    real best_split = 0;
+    for (int a = 0; a < 3; a += 1) {
+        real extent = cmax[a] - cmin[a];
+        if (extent <= 0) {
+            continue;
+        }
+        int bin_count[BVH_BINS] = {0};
+        real bin_min[BVH_BINS][3], bin_max[BVH_BINS][3];
+        for (int b = 0; b < BVH_BINS; b += 1) {
+            for (int k = 0; k < 3; k += 1) {
+                bin_min[b][k] = INFINITY;
+                bin_max[b][k] = -INFINITY;
+            }
+        }
+        real scale = BVH_BINS / extent;
+        for (int i = first; i < first + count; i += 1) {
+            int b = (int)((objects[bvh_prims[i]]->center[a] - cmin[a]) * scale);
+            if (b >= BVH_BINS) b = BVH_BINS - 1;
+            bin_count[b] += 1;
+            bvh_grow(bin_min[b], bin_max[b], bvh_prims[i]);
+        }
+        //sweep from the right to get the area of every right-hand side
+        real right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        real mn[3] = {INFINITY, INFINITY, INFINITY};
+        real mx[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int total = 0;
+        for (int b = BVH_BINS - 1; b > 0; b -= 1) {
+            for (int k = 0; k < 3; k += 1) {
+                if (bin_min[b][k] < mn[k]) mn[k] = bin_min[b][k];
+                if (bin_max[b][k] > mx[k]) mx[k] = bin_max[b][k];
+            }
+            total += bin_count[b];
+            right_count[b] = total;
+            right_area[b] = total ? bvh_area(mn, mx) : 0;
+        }
+        for (int k = 0; k < 3; k += 1) {
+            mn[k] = INFINITY;
+            mx[k] = -INFINITY;
+        }
+        total = 0;
+        for (int b = 0; b < BVH_BINS - 1; b += 1) {
+            for (int k = 0; k < 3; k += 1) {
+                if (bin_min[b][k] < mn[k]) mn[k] = bin_min[b][k];
+                if (bin_max[b][k] > mx[k]) mx[k] = bin_max[b][k];
+            }
+            total += bin_count[b];
+            if (total == 0 || right_count[b + 1] == 0) {
+                continue;
+            }
+            real cost = 1 + total * bvh_area(mn, mx) + right_count[b + 1] * right_area[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_split = cmin[a] + (b + 1) / scale;
+            }
+        }
+    }
+    if (best_axis < 0) {
+        return;
+    }
+
+    //partition the primitives around the chosen plane
+    int i = first;
+    int j = first + count - 1;
+    while (i <= j) {
+        if (objects[bvh_prims[i]]->center[best_axis] < best_split) {
+            i += 1;
+        } else {
+            int tmp = bvh_prims[i];
+            bvh_prims[i] = bvh_prims[j];
+            bvh_prims[j] = tmp;
+            j -= 1;
+        }
+    }
+    int left_count = i - first;
+    if (left_count == 0 || left_count == count) {
+        return;
+    }
+    int left = bvh_node_count;
+    bvh_node_count += 2;
+    node->left_first = left;
+    node->count = 0;
+    bvh_build_node(left, first, left_count, depth + 1);
+    bvh_build_node(left + 1, i, count - left_count, depth + 1);
+}
+
+//builds the sphere BVH and the plane list from objects
+void build_bvh(void) {
+    int count = object_count;
+    bvh_prims = malloc(sizeof(int) * (count + 1));
+    plane_list = malloc(sizeof(int) * (count + 1));
+    bvh_nodes = malloc(sizeof(BVHNode) * (2 * count + 1));
+    bvh_prim_count = 0;
+    plane_count = 0;
+    for (int i = 0; i < count; i += 1) {
+        if (objects[i]->kind == 1) {
+            bvh_prims[bvh_prim_count++] = i;
+        } else {
+            plane_list[plane_count++] = i;
+        }
+    }
+    bvh_node_count = 1;
+    if (bvh_prim_count == 0) {
+        bvh_node_count = 0;
+        return;
+    }
+    bvh_build_node(0, 0, bvh_prim_count, 0);
+}
+
+//Structure-of-arrays copy of the geometry, packed by compile_scene() once the
+//BVH is built. Spheres are stored in BVH leaf order so every leaf is one
+//contiguous run, and each array is padded by SIMD_WIDTH zeroed entries so
+//the kernels can always load a full vector.
+typedef struct {
+    int count;
+    real* x;
+    real* y;
+    real* z;
+    real* r2;
+    int* id;
+} SphereStore;
+
+typedef struct {
+    int count;
+    real* nx;
+    real* ny;
+    real* nz;
+    real* d;
+    int* id;
+} PlaneStore;
+
+//surface colors of every object, indexed like objects, so shading reads a
+//flat record instead of picking fields out of the Object union by kind
+typedef struct {
+    real diffuse[3];
+    real specular[3];
+} Material;
+
+SphereStore spheres;
+PlaneStore planes;
+Material* materials;
+
+static real* packed_array(int count) {
+    return calloc(count + SIMD_WIDTH, sizeof(real));
+}
+
+//copies the spheres and planes out of objects into the packed stores and
+//builds the material table
+void compile_scene(void) {
+    materials = malloc(sizeof(Material) * (object_count + 1));
+    for (int i = 0; i < object_count; i += 1) {
+        real* diffuse = objects[i]->kind == 1 ? objects[i]->sphere.difuse_color : objects[i]->plane.difuse_color;
+        real* specular = objects[i]->kind == 1 ? objects[i]->sphere.specular_color : objects[i]->plane.specular_color;
+        memcpy(materials[i].diffuse, diffuse, sizeof(real) * 3);
+        memcpy(materials[i].specular, specular, sizeof(real) * 3);
+    }
+    spheres.count = bvh_prim_count;
+    spheres.x = packed_array(spheres.count);
+    spheres.y = packed_array(spheres.count);
+    spheres.z = packed_array(spheres.count);
+    spheres.r2 = packed_array(spheres.count);
+    spheres.id = malloc(sizeof(int) * (spheres.count + 1));
+    for (int i = 0; i < spheres.count; i += 1) {
+        Object* o = objects[bvh_prims[i]];
+        spheres.x[i] = o->center[0];
+        spheres.y[i] = o->center[1];
+        spheres.z[i] = o->center[2];
+        spheres.r2[i] = sqr(o->sphere.radius);
+        spheres.id[i] = bvh_prims[i];
+    }
+    planes.count = plane_count;
+    planes.nx = packed_array(plane_count);
+    planes.ny = packed_array(plane_count);
+    planes.nz = packed_array(plane_count);
+    planes.d = packed_array(plane_count);
+    planes.id = malloc(sizeof(int) * (plane_count + 1));
+    for (int i = 0; i < plane_count; i += 1) {
+        Object* o = objects[plane_list[i]];
+        real* normal = o->plane.normal;
+        planes.nx[i] = normal[0];
+        planes.ny[i] = normal[1];
+        planes.nz[i] = normal[2];
+        planes.d[i] = normal[0]*o->center[0] + normal[1]*o->center[1] + normal[2]*o->center[2];
+        planes.id[i] = plane_list[i];
+    }
+}
+
+//The kernels below intersect one ray with SIMD_WIDTH consecutive packed
+//primitives starting at first and write each distance (or -1) to t. Every
+//variant evaluates the same expressions in the same order as
+//sphere_intersection/plane_intersection, so they all return identical hits.
+static void sphere_kernel_scalar(real* Ro, real* Rd, int first, real* t) {
+  real a = sqr(Rd[0]) + sqr(Rd[2]) + sqr(Rd[1]);
+  for (int i = 0; i < SIMD_WIDTH; i += 1) {
+    real ox = Ro[0] - spheres.x[first + i];
+    real oy = Ro[1] - spheres.y[first + i];
+    real oz = Ro[2] - spheres.z[first + i];
+    real b = (2 * (Rd[0] * ox + Rd[2] * oz + Rd[1] * oy));
+    real c = sqr(ox) + sqr(oz) + sqr(oy) - spheres.r2[first + i];
+    real det = sqr(b) - 4 * a * c;
+    t[i] = -1;
+    if (det < 0)
+        continue;
+    det = sqrt(det);
+    real t0 = (-b - det) / (2*a);
+    real t1 = (-b + det) / (2*a);
+    if (t0 > 0)
+        t[i] = t0;
+    else if (t1 > 0)
+        t[i] = t1;
+  }
+}
+
+static void plane_kernel_scalar(real* Ro, real* Rd, int first, real* t) {
+    for (int i = 0; i < SIMD_WIDTH; i += 1) {
+        real nx = planes.nx[first + i], ny = planes.ny[first + i], nz = planes.nz[first + i];
+        real p = -(nx*Ro[0] + ny*Ro[1] + nz*Ro[2] + planes.d[first + i])/(nx*Rd[0] + ny*Rd[1] + nz*Rd[2]);
+        t[i] = p > 0 ? p : -1;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//AVX(op) and SSE(op) name the intrinsic for real, so one kernel body serves
+//both precisions: an AVX vector holds SIMD_WIDTH reals, an SSE one half that
+#ifdef RAYCAST_FLOAT
+typedef __m256 avx_real;
+typedef __m128 sse_real;
+#define AVX(op) _mm256_##op##_ps
+#define SSE(op) _mm_##op##_ps
+#else
+typedef __m256d avx_real;
+typedef __m128d sse_real;
+#define AVX(op) _mm256_##op##_pd
+#define SSE(op) _mm_##op##_pd
+#endif
+#define SSE_LANES (SIMD_WIDTH / 2)
+
+__attribute__((target("avx")))
+static void sphere_kernel_avx(real* Ro, real* Rd, int first, real* t) {
+    real a = sqr(Rd[0]) + sqr(Rd[2]) + sqr(Rd[1]);
+    avx_real dx = AVX(set1)(Rd[0]), dy = AVX(set1)(Rd[1]), dz = AVX(set1)(Rd[2]);
+    avx_real ox = AVX(sub)(AVX(set1)(Ro[0]), AVX(loadu)(spheres.x + first));
+    avx_real oy = AVX(sub)(AVX(set1)(Ro[1]), AVX(loadu)(spheres.y + first));
+    avx_real oz = AVX(sub)(AVX(set1)(Ro[2]), AVX(loadu)(spheres.z + first));
+    avx_real b = AVX(add)(AVX(add)(AVX(mul)(dx, ox), AVX(mul)(dz, oz)), AVX(mul)(dy, oy));
+    b = AVX(mul)(AVX(set1)(2), b);
+    avx_real c = AVX(add)(AVX(add)(AVX(mul)(ox, ox), AVX(mul)(oz, oz)), AVX(mul)(oy, oy));
+    c = AVX(sub)(c, AVX(loadu)(spheres.r2 + first));
+    avx_real det = AVX(sub)(AVX(mul)(b, b), AVX(mul)(AVX(set1)(4 * a), c));
+    avx_real hit = AVX(cmp)(det, AVX(setzero)(), _CMP_GE_OQ);
+    det = AVX(sqrt)(AVX(max)(det, AVX(setzero)()));
+    avx_real nb = AVX(xor)(b, AVX(set1)(-0.0));
+    avx_real two_a = AVX(set1)(2*a);
+    avx_real t0 = AVX(div)(AVX(sub)(nb, det), two_a);
+    avx_real t1 = AVX(div)(AVX(add)(nb, det), two_a);
+    avx_real zero = AVX(setzero)();
+    avx_real r = AVX(blendv)(AVX(set1)(-1), t1, AVX(cmp)(t1, zero, _CMP_GT_OQ));
+    r = AVX(blendv)(r, t0, AVX(cmp)(t0, zero, _CMP_GT_OQ));
+    r = AVX(blendv)(AVX(set1)(-1), r, hit);
+    AVX(storeu)(t, r);
+}
+
+__attribute__((target("avx")))
+static void plane_kernel_avx(real* Ro, real* Rd, int first, real* t) {
+    avx_real nx = AVX(loadu)(planes.nx + first);
+    avx_real ny = AVX(loadu)(planes.ny + first);
+    avx_real nz = AVX(loadu)(planes.nz + first);
+    avx_real num = AVX(add)(AVX(add)(AVX(mul)(nx, AVX(set1)(Ro[0])),
+            AVX(mul)(ny, AVX(set1)(Ro[1]))), AVX(mul)(nz, AVX(set1)(Ro[2])));
+    num = AVX(add)(num, AVX(loadu)(planes.d + first));
+    avx_real den = AVX(add)(AVX(add)(AVX(mul)(nx, AVX(set1)(Rd[0])),
+            AVX(mul)(ny, AVX(set1)(Rd[1]))), AVX(mul)(nz, AVX(set1)(Rd[2])));
+    avx_real p = AVX(div)(AVX(xor)(num, AVX(set1)(-0.0)), den);
+    p = AVX(blendv)(AVX(set1)(-1), p, AVX(cmp)(p, AVX(setzero)(), _CMP_GT_OQ));
+    AVX(storeu)(t, p);
+}
+
+//SSE2 is always there on x86-64, so this handles SSE_LANES lanes at a time
+static void sphere_kernel_sse(real* Ro, real* Rd, int first, real* t) {
+    real a = sqr(Rd[0]) + sqr(Rd[2]) + sqr(Rd[1]);
+    sse_real two_a = SSE(set1)(2*a), four_a = SSE(set1)(4 * a);
+    sse_real zero = SSE(setzero)(), minus_one = SSE(set1)(-1), sign = SSE(set1)(-0.0);
+    for (int i = 0; i < SIMD_WIDTH; i += SSE_LANES) {
+        sse_real ox = SSE(sub)(SSE(set1)(Ro[0]), SSE(loadu)(spheres.x + first + i));
+        sse_real oy = SSE(sub)(SSE(set1)(Ro[1]), SSE(loadu)(spheres.y + first + i));
+        sse_real oz = SSE(sub)(SSE(set1)(Ro[2]), SSE(loadu)(spheres.z + first + i));
+        sse_real b = SSE(add)(SSE(add)(SSE(mul)(SSE(set1)(Rd[0]), ox), SSE(mul)(SSE(set1)(Rd[2]), oz)),
+                SSE(mul)(SSE(set1)(Rd[1]), oy));
+        b = SSE(mul)(SSE(set1)(2), b);
+        sse_real c = SSE(add)(SSE(add)(SSE(mul)(ox, ox), SSE(mul)(oz, oz)), SSE(mul)(oy, oy));
+        c = SSE(sub)(c, SSE(loadu)(spheres.r2 + first + i));
+        sse_real det = SSE(sub)(SSE(mul)(b, b), SSE(mul)(four_a, c));
+        sse_real hit = SSE(cmpge)(det, zero);
+        det = SSE(sqrt)(SSE(max)(det, zero));
+        sse_real nb = SSE(xor)(b, sign);
+        sse_real t0 = SSE(div)(SSE(sub)(nb, det), two_a);
+        sse_real t1 = SSE(div)(SSE(add)(nb, det), two_a);
+        sse_real m1 = SSE(cmpgt)(t1, zero);
+        sse_real r = SSE(or)(SSE(and)(m1, t1), SSE(andnot)(m1, minus_one));
+        sse_real m0 = SSE(cmpgt)(t0, zero);
+        r = SSE(or)(SSE(and)(m0, t0), SSE(andnot)(m0, r));
+        r = SSE(or)(SSE(and)(hit, r), SSE(andnot)(hit, minus_one));
+        SSE(storeu)(t + i, r);
+    }
+}
+#endif
+
+void (*sphere_kernel)(real* Ro, real* Rd, int first, real* t) = sphere_kernel_scalar;
+void (*plane_kernel)(real* Ro, real* Rd, int first, real* t) = plane_kernel_scalar;
+
+//slab test; returns the entry distance or INFINITY if the box is missed
+static inline real bvh_box(BVHNode* node, real* Ro, real* inv, real t_max) {
+    real t0 = 0, t1 = t_max;
+    STAT_ADD(box_tests, 1);
+    for (int a = 0; a < 3; a += 1) {
+        real ta = (node->min[a] - Ro[a]) * inv[a];
+        real tb = (node->max[a] - Ro[a]) * inv[a];
+        if (ta > tb) {
+            real tmp = ta;
+            ta = tb;
+            tb = tmp;
+        }
+        if (ta > t0) t0 = ta;
+        if (tb < t1) t1 = tb;
+        if (t0 > t1) return INFINITY;
+    }
+    return t0;
+}
+
+//Uniform grid over the spheres, the alternative to the BVH for dense, even
+//particle fields (--accel grid). It is built in O(n) by counting sort after
+//compile_scene(): every sphere is listed in each cell its bounding box
+//touches, by its slot in the SoA store. The resolution is picked so there
+//are about GRID_DENSITY cells per sphere, shaped like the scene's bounds.
+//Rays walk the cells with a 3D-DDA. A sphere spanning several cells would
+//be met again in each, so a small per-thread mailbox remembers which slots
+//the current ray has already tested; it is direct mapped, so a collision
+//only costs a repeated test. Planes are still tested one by one.
+#define GRID_DENSITY 3
+#define GRID_MAX_DIM 512
+#define MAILBOX_SIZE 64
+
+typedef struct {
+    real min[3];
+    real max[3];
+    real cell[3];
+    int dims[3];
+} GridShape;
+
+int use_grid;
+GridShape grid;
+int* grid_start;
+int* grid_items;
+
+typedef struct {
+    uint32_t ray;
+    int slot;
+} MailboxEntry;
+
+static _Thread_local MailboxEntry mailbox[MAILBOX_SIZE];
+static _Thread_local uint32_t mailbox_ray;
+
+//cell coordinate of v along axis a, clamped to the grid
+static inline int grid_coord(real v, int a) {
+    int c = (int)floor((v - grid.min[a]) / grid.cell[a]);
+    return c < 0 ? 0 : c >= grid.dims[a] ? grid.dims[a] - 1 : c;
+}
+
+void free_grid(void) {
+    free(grid_start);
+    free(grid_items);
+    grid_start = NULL;
+    grid_items = NULL;
+}
+
+//(re)builds the grid from the packed spheres
+void build_grid(void) {
+    free_grid();
+    memset(&grid, 0, sizeof(grid));
+    int n = spheres.count;
+    if (n == 0) {
+        return;
+    }
+    for (int a = 0; a < 3; a += 1) {
+        grid.min[a] = INFINITY;
+        grid.max[a] = -INFINITY;
+    }
+    real* centers[3] = {spheres.x, spheres.y, spheres.z};
+    for (int i = 0; i < n; i += 1) {
+        real r = sqrt(spheres.r2[i]);
+        for (int a = 0; a < 3; a += 1) {
+            grid.min[a] = fmin(grid.min[a], centers[a][i] - r);
+            grid.max[a] = fmax(grid.max[a], centers[a][i] + r);
+        }
+    }
+    //a flat scene still gets some depth so the volume is not zero
+    real largest = fmax(grid.max[0] - grid.min[0], fmax(grid.max[1] - grid.min[1], grid.max[2] - grid.min[2]));
+    real extent[3];
+    real volume = 1;
+    for (int a = 0; a < 3; a += 1) {
+        extent[a] = fmax(grid.max[a] - grid.min[a], largest * 1e-3);
+        grid.max[a] = grid.min[a] + extent[a];
+        volume *= extent[a];
+    }
+    real per_unit = cbrt(GRID_DENSITY * n / volume);
+    long cells = 1;
+    for (int a = 0; a < 3; a += 1) {
+        int d = (int)(extent[a] * per_unit);
+        grid.dims[a] = d < 1 ? 1 : d > GRID_MAX_DIM ? GRID_MAX_DIM : d;
+        grid.cell[a] = extent[a] / grid.dims[a];
+        cells *= grid.dims[a];
+    }
+    //count, prefix sum, then fill: grid_start[c] .. grid_start[c + 1]
+    grid_start = calloc(cells + 1, sizeof(int));
+    for (int pass = 0; pass < 2; pass += 1) {
+        for (int i = 0; i < n; i += 1) {
+            real r = sqrt(spheres.r2[i]);
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; a += 1) {
+                lo[a] = grid_coord(centers[a][i] - r, a);
+                hi[a] = grid_coord(centers[a][i] + r, a);
+            }
+            for (int z = lo[2]; z <= hi[2]; z += 1) {
+                for (int y = lo[1]; y <= hi[1]; y += 1) {
+                    for (int x = lo[0]; x <= hi[0]; x += 1) {
+                        long c = ((long)z * grid.dims[1] + y) * grid.dims[0] + x;
+                        if (pass == 0) {
+                            grid_start[c + 1] += 1;
+                        } else {
+                            grid_items[grid_start[c]++] = i;
+                        }
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            for (long c = 0; c < cells; c += 1) {
+                grid_start[c + 1] += grid_start[c];
+            }
+            grid_items = malloc(sizeof(int) * (grid_start[cells] > 0 ? grid_start[cells] : 1));
+        }
+    }
+    //filling advanced every start to the next cell's; shift them back
+    for (long c = cells; c > 0; c -= 1) {
+        grid_start[c] = grid_start[c - 1];
+    }
+    grid_start[0] = 0;
+}
+
+//distance to packed sphere s, or -1; the same expressions as
+//sphere_kernel_scalar so the grid finds exactly the BVH's hits
+static inline real grid_sphere(real* Ro, real* Rd, real a, int s) {
+    real ox = Ro[0] - spheres.x[s];
+    real oy = Ro[1] - spheres.y[s];
+    real oz = Ro[2] - spheres.z[s];
+    real b = (2 * (Rd[0] * ox + Rd[2] * oz + Rd[1] * oy));
+    real c = sqr(ox) + sqr(oz) + sqr(oy) - spheres.r2[s];
+    real det = sqr(b) - 4 * a * c;
+    if (det < 0)
+        return -1;
+    det = sqrt(det);
+    real t0 = (-b - det) / (2*a);
+    real t1 = (-b + det) / (2*a);
+    if (t0 > 0)
+        return t0;
+    if (t1 > 0)
+        return t1;
+    return -1;
+}
+
+//walks the grid along the ray. Closest hit: keeps the nearest sphere
+//nearer than *limit in *limit and best, and returns best. Any hit
+//(any_hit set): returns the first sphere other than skip with a distance in
+//(t_min, *limit], or -1.
+static int grid_trace(real* Ro, real* Rd, real* limit, int best, int any_hit, int skip, real t_min) {
+    if (grid_start == NULL) {
+        return any_hit ? -1 : best;
+    }
+    //where the ray is inside the grid's box
+    real t_enter = 0;
+    real t_exit = *limit;
+    for (int a = 0; a < 3; a += 1) {
+        real inv = 1 / Rd[a];
+        real ta = (grid.min[a] - Ro[a]) * inv;
+        real tb = (grid.max[a] - Ro[a]) * inv;
+        if (ta > tb) {
+            real tmp = ta;
+            ta = tb;
+            tb = tmp;
+        }
+        t_enter = ta > t_enter ? ta : t_enter;
+        t_exit = tb < t_exit ? tb : t_exit;
+    }
+    if (!(t_enter <= t_exit)) {
+        return any_hit ? -1 : best;
+    }
+    mailbox_ray += 1;
+    if (mailbox_ray == 0) {
+        memset(mailbox, 0, sizeof(mailbox));
+        mailbox_ray = 1;
+    }
+    int cell[3], step[3];
+    real t_next[3], t_delta[3];
+    for (int a = 0; a < 3; a += 1) {
+        cell[a] = grid_coord(Ro[a] + Rd[a] * t_enter, a);
+        if (Rd[a] > 0) {
+            step[a] = 1;
+            t_delta[a] = grid.cell[a] / Rd[a];
+            t_next[a] = (grid.min[a] + (cell[a] + 1) * grid.cell[a] - Ro[a]) / Rd[a];
+        } else if (Rd[a] < 0) {
+            step[a] = -1;
+            t_delta[a] = -grid.cell[a] / Rd[a];
+            t_next[a] = (grid.min[a] + cell[a] * grid.cell[a] - Ro[a]) / Rd[a];
+        } else {
+            step[a] = 0;
+            t_delta[a] = INFINITY;
+            t_next[a] = INFINITY;
+        }
+    }
+    real a2 = sqr(Rd[0]) + sqr(Rd[2]) + sqr(Rd[1]);
+    while (1) {
+        STAT_ADD(grid_cells, 1);
+        long c = ((long)cell[2] * grid.dims[1] + cell[1]) * grid.dims[0] + cell[0];
+        for (int i = grid_start[c]; i < grid_start[c + 1]; i += 1) {
+            int s = grid_items[i];
+            MailboxEntry* m = &mailbox[s & (MAILBOX_SIZE - 1)];
+            if (m->ray == mailbox_ray && m->slot == s) {
+                STAT_ADD(mailbox_hits, 1);
+                continue;
+            }
+            m->ray = mailbox_ray;
+            m->slot = s;
+            STAT_ADD(sphere_tests, 1);
+            real t = grid_sphere(Ro, Rd, a2, s);
+            int k = spheres.id[s];
+            if (any_hit) {
+                if (k != skip && t > t_min && t <= *limit) {
+                    return k;
+                }
+            } else if (t > 0 && (t < *limit || (t == *limit && k < best))) {
+                *limit = t;
+                best = k;
+            }
+        }
+        //step into the neighbour across the nearest cell wall
+        int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        if (t_next[axis] > *limit || t_next[axis] > t_exit) {
+            break;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= grid.dims[axis]) {
+            break;
+        }
+        t_next[axis] += t_delta[axis];
+    }
+    return any_hit ? -1 : best;
+}
+
+//closest-hit query. Returns the index into objects of the nearest object in
+//front of the ray (or -1) and stores its distance in best_t.
+int closest_hit(real* Ro, real* Rd, real* best_t) {
+    int best = -1;
+    real t[SIMD_WIDTH];
+    *best_t = INFINITY;
+    for (int p = 0; p < planes.count; p += SIMD_WIDTH) {
+        plane_kernel(Ro, Rd, p, t);
+        STAT_ADD(plane_tests, planes.count - p < SIMD_WIDTH ? planes.count - p : SIMD_WIDTH);
+        for (int l = 0; l < SIMD_WIDTH && p + l < planes.count; l += 1) {
+            if (t[l] > 0 && t[l] < *best_t) {
+                *best_t = t[l];
+                best = planes.id[p + l];
+            }
+        }
+    }
+    if (use_grid) {
+        return grid_trace(Ro, Rd, best_t, best, 0, -1, 0);
+    }
+    if (bvh_node_count == 0) {
+        return best;
+    }
+    real inv[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+    int stack[BVH_STACK];
+    int top = 0;
+    if (bvh_box(&bvh_nodes[0], Ro, inv, *best_t) == INFINITY) {
+        return best;
+    }
+    stack[top++] = 0;
+    while (top > 0) {
+        BVHNode* node = &bvh_nodes[stack[--top]];
+        if (node->count > 0) {
+            int end = node->left_first + node->count;
+            for (int i = node->left_first; i < end; i += SIMD_WIDTH) {
+                sphere_kernel(Ro, Rd, i, t);
+                STAT_ADD(sphere_tests, end - i < SIMD_WIDTH ? end - i : SIMD_WIDTH);
+                for (int l = 0; l < SIMD_WIDTH && i + l < end; l += 1) {
+                    int k = spheres.id[i + l];
+                    if (t[l] > 0 && (t[l] < *best_t || (t[l] == *best_t && k < best))) {
+                        *best_t = t[l];
+                        best = k;
+                    }
+                }
+            }
+            continue;
+        }
+        //visit the nearer child first so the far one is usually culled
+        int near = node->left_first, far = node->left_first + 1;
+        real t_near = bvh_box(&bvh_nodes[near], Ro, inv, *best_t);
+        real t_far = bvh_box(&bvh_nodes[far], Ro, inv, *best_t);
+        if (t_far < t_near) {
+            int tmp = near;
+            near = far;
+            far = tmp;
+            real tt = t_near;
+            t_near = t_far;
+            t_far = tt;
+        }
+        if (t_far != INFINITY) stack[top++] = far;
+        if (t_near != INFINITY) stack[top++] = near;
+    }
+    return best;
+}
+
+//Per-light shadow culling, filled in by compile_lights(). A light
+//whose spot term is zero lights nothing, so it needs no shadow rays at all.
+unsigned char* light_active;
+
+//shadow rays ignore blockers closer than this, so rounding in the hit point
+//cannot shadow a surface with whatever it touches
+real shadow_epsilon;
+
+//any-hit query for shadow rays: returns the index of an object other than
+//objects[skip] in the way within distance dl, or -1
+int occluded(real* Ro, real* Rd, real dl, int skip) {
+    real t[SIMD_WIDTH];
+    for (int p = 0; p < planes.count; p += SIMD_WIDTH) {
+        plane_kernel(Ro, Rd, p, t);
+        STAT_ADD(plane_tests, planes.count - p < SIMD_WIDTH ? planes.count - p : SIMD_WIDTH);
+        for (int l = 0; l < SIMD_WIDTH && p + l < planes.count; l += 1) {
+            if (planes.id[p + l] != skip && t[l] > shadow_epsilon && t[l] <= dl) {
+                return planes.id[p + l];
+            }
+        }
+    }
+    if (use_grid) {
+        return grid_trace(Ro, Rd, &dl, -1, 1, skip, shadow_epsilon);
+    }
+    if (bvh_node_count == 0) {
+        return -1;
+    }
+    real inv[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+    int stack[BVH_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int n = stack[--top];
+        BVHNode* node = &bvh_nodes[n];
+        if (bvh_box(node, Ro, inv, dl) == INFINITY) {
+            continue;
+        }
+        if (node->count > 0) {
+            int end = node->left_first + node->count;
+            for (int i = node->left_first; i < end; i += SIMD_WIDTH) {
+                sphere_kernel(Ro, Rd, i, t);
+                STAT_ADD(sphere_tests, end - i < SIMD_WIDTH ? end - i : SIMD_WIDTH);
+                for (int l = 0; l < SIMD_WIDTH && i + l < end; l += 1) {
+                    if (spheres.id[i + l] != skip && t[l] > shadow_epsilon && t[l] <= dl) {
+                        return spheres.id[i + l];
+                    }
+                }
+            }
+            continue;
+        }
+        stack[top++] = node->left_first + 1;
+        stack[top++] = node->left_first;
+    }
+    return -1;
+}
+
+//A bundle of rays traced together through the BVH. Origins and directions
+//are stored per lane; t is each lane's limit (closest hit so far, or the
+//distance to the light) and lanes with a negative limit sit idle.
+#define PACKET_DIM 4
+#define PACKET_SIZE (PACKET_DIM * PACKET_DIM)
+
+typedef struct {
+    int count;
+    real ox[PACKET_SIZE];
+    real oy[PACKET_SIZE];
+    real oz[PACKET_SIZE];
+    real dx[PACKET_SIZE];
+    real dy[PACKET_SIZE];
+    real dz[PACKET_SIZE];
+    real ix[PACKET_SIZE];
+    real iy[PACKET_SIZE];
+    real iz[PACKET_SIZE];
+    real t[PACKET_SIZE];
+    int hit[PACKET_SIZE];
+    int skip[PACKET_SIZE];
+} RayPacket;
+
+static inline void packet_set_ray(RayPacket* p, int l, real* Ro, real* Rd) {
+    p->ox[l] = Ro[0];
+    p->oy[l] = Ro[1];
+    p->oz[l] = Ro[2];
+    p->dx[l] = Rd[0];
+    p->dy[l] = Rd[1];
+    p->dz[l] = Rd[2];
+    p->ix[l] = 1 / Rd[0];
+    p->iy[l] = 1 / Rd[1];
+    p->iz[l] = 1 / Rd[2];
+}
+
+//does any live lane enter the node box within its limit? Lanes that already
+//found a blocker are left out when any_hit is set.
+static int packet_box(RayPacket* p, BVHNode* node, int any_hit) {
+    for (int l = 0; l < p->count; l += 1) {
+        if (p->t[l] < 0 || (any_hit && p->hit[l] >= 0)) {
+            continue;
+        }
+        real Ro[3] = {p->ox[l], p->oy[l], p->oz[l]};
+        real inv[3] = {p->ix[l], p->iy[l], p->iz[l]};
+        if (bvh_box(node, Ro, inv, p->t[l]) != INFINITY) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//packet versions of the sphere kernel: one packed sphere s against every
+//lane, same expression order as sphere_kernel_scalar
+static void sphere_packet_scalar(RayPacket* p, int s, real* t) {
+  for (int l = 0; l < PACKET_SIZE; l += 1) {
+    real a = sqr(p->dx[l]) + sqr(p->dz[l]) + sqr(p->dy[l]);
+    real ox = p->ox[l] - spheres.x[s];
+    real oy = p->oy[l] - spheres.y[s];
+    real oz = p->oz[l] - spheres.z[s];
+    real b = (2 * (p->dx[l] * ox + p->dz[l] * oz + p->dy[l] * oy));
+    real c = sqr(ox) + sqr(oz) + sqr(oy) - spheres.r2[s];
+    real det = sqr(b) - 4 * a * c;
+    t[l] = -1;
+    if (det < 0)
+        continue;
+    det = sqrt(det);
+    real t0 = (-b - det) / (2*a);
+    real t1 = (-b + det) / (2*a);
+    if (t0 > 0)
+        t[l] = t0;
+    else if (t1 > 0)
+        t[l] = t1;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx")))
+static void sphere_packet_avx(RayPacket* p, int s, real* t) {
+    avx_real cx = AVX(set1)(spheres.x[s]);
+    avx_real cy = AVX(set1)(spheres.y[s]);
+    avx_real cz = AVX(set1)(spheres.z[s]);
+    avx_real r2 = AVX(set1)(spheres.r2[s]);
+    avx_real zero = AVX(setzero)(), minus_one = AVX(set1)(-1), sign = AVX(set1)(-0.0);
+    for (int l = 0; l < PACKET_SIZE; l += SIMD_WIDTH) {
+        avx_real dx = AVX(loadu)(p->dx + l), dy = AVX(loadu)(p->dy + l), dz = AVX(loadu)(p->dz + l);
+        avx_real a = AVX(add)(AVX(add)(AVX(mul)(dx, dx), AVX(mul)(dz, dz)), AVX(mul)(dy, dy));
+        avx_real ox = AVX(sub)(AVX(loadu)(p->ox + l), cx);
+        avx_real oy = AVX(sub)(AVX(loadu)(p->oy + l), cy);
+        avx_real oz = AVX(sub)(AVX(loadu)(p->oz + l), cz);
+        avx_real b = AVX(add)(AVX(add)(AVX(mul)(dx, ox), AVX(mul)(dz, oz)), AVX(mul)(dy, oy));
+        b = AVX(mul)(AVX(set1)(2), b);
+        avx_real c = AVX(add)(AVX(add)(AVX(mul)(ox, ox), AVX(mul)(oz, oz)), AVX(mul)(oy, oy));
+        c = AVX(sub)(c, r2);
+        avx_real det = AVX(sub)(AVX(mul)(b, b), AVX(mul)(AVX(mul)(AVX(set1)(4), a), c));
+        avx_real hit = AVX(cmp)(det, zero, _CMP_GE_OQ);
+        if (AVX(movemask)(hit) == 0) {
+            AVX(storeu)(t + l, minus_one);
+            continue;
+        }
+        det = AVX(sqrt)(AVX(max)(det, zero));
+        avx_real nb = AVX(xor)(b, sign);
+        avx_real two_a = AVX(mul)(AVX(set1)(2), a);
+        avx_real t0 = AVX(div)(AVX(sub)(nb, det), two_a);
+        avx_real t1 = AVX(div)(AVX(add)(nb, det), two_a);
+        avx_real r = AVX(blendv)(minus_one, t1, AVX(cmp)(t1, zero, _CMP_GT_OQ));
+        r = AVX(blendv)(r, t0, AVX(cmp)(t0, zero, _CMP_GT_OQ));
+        AVX(storeu)(t + l, AVX(blendv)(minus_one, r, hit));
+    }
+}
+#endif
+
+void (*sphere_packet)(RayPacket* p, int s, real* t) = sphere_packet_scalar;
+
+//plane q against one lane, same expressions as plane_kernel_scalar
+static inline real packet_plane(RayPacket* p, int q, int l) {
+    real nx = planes.nx[q], ny = planes.ny[q], nz = planes.nz[q];
+    STAT_ADD(plane_tests, 1);
+    real t = -(nx*p->ox[l] + ny*p->oy[l] + nz*p->oz[l] + planes.d[q])/(nx*p->dx[l] + ny*p->dy[l] + nz*p->dz[l]);
+    return t > 0 ? t : -1;
+}
+
+//closest-hit query for a whole packet. Each live lane ends with its nearest
+//object in hit (or -1) and the distance in t; a BVH node is skipped as soon
+//as every lane misses its box.
+void packet_closest_hit(RayPacket* p) {
+    real t[PACKET_SIZE];
+    for (int l = 0; l < PACKET_SIZE; l += 1) {
+        p->hit[l] = -1;
+    }
+    for (int q = 0; q < planes.count; q += 1) {
+        for (int l = 0; l < p->count; l += 1) {
+            real tq = packet_plane(p, q, l);
+            if (tq > 0 && tq < p->t[l]) {
+                p->t[l] = tq;
+                p->hit[l] = planes.id[q];
+            }
+        }
+    }
+    if (bvh_node_count == 0) {
+        return;
+    }
+    int stack[BVH_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        BVHNode* node = &bvh_nodes[stack[--top]];
+        if (!packet_box(p, node, 0)) {
+            continue;
+        }
+        if (node->count > 0) {
+            for (int i = node->left_first; i < node->left_first + node->count; i += 1) {
+                int k = spheres.id[i];
+                sphere_packet(p, i, t);
+                STAT_ADD(sphere_tests, p->count);
+                for (int l = 0; l < p->count; l += 1) {
+                    if (t[l] > 0 && (t[l] < p->t[l] || (t[l] == p->t[l] && k < p->hit[l]))) {
+                        p->t[l] = t[l];
+                        p->hit[l] = k;
+                    }
+                }
+            }
+            continue;
+        }
+        stack[top++] = node->left_first + 1;
+        stack[top++] = node->left_first;
+    }
+}
+
+//any-hit query for a packet of shadow rays. A lane's hit is set to the first
+//blocker found closer than its t, skipping that lane's own object; lanes the
+//caller already marked blocked are left alone and the walk stops once every
+//live lane is blocked.
+void packet_occluded(RayPacket* p) {
+    real t[PACKET_SIZE];
+    int open = 0;
+    for (int l = 0; l < p->count; l += 1) {
+        if (p->t[l] >= 0 && p->hit[l] < 0) {
+            open += 1;
+        }
+    }
+    for (int q = 0; q < planes.count && open > 0; q += 1) {
+        for (int l = 0; l < p->count; l += 1) {
+            if (p->t[l] < 0 || p->hit[l] >= 0 || planes.id[q] == p->skip[l]) {
+                continue;
+            }
+            real tq = packet_plane(p, q, l);
+            if (tq > shadow_epsilon && tq <= p->t[l]) {
+                p->hit[l] = planes.id[q];
+                open -= 1;
+            }
+        }
+    }
+    if (bvh_node_count == 0) {
+        return;
+    }
+    int stack[BVH_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0 && open > 0) {
+        int n = stack[--top];
+        BVHNode* node = &bvh_nodes[n];
+        if (!packet_box(p, node, 1)) {
+            continue;
+        }
+        if (node->count > 0) {
+            for (int i = node->left_first; i < node->left_first + node->count && open > 0; i += 1) {
+                int k = spheres.id[i];
+                sphere_packet(p, i, t);
+                STAT_ADD(sphere_tests, p->count);
+                for (int l = 0; l < p->count; l += 1) {
+                    if (p->t[l] < 0 || p->hit[l] >= 0 || k == p->skip[l]) {
+                        continue;
+                    }
+                    if (t[l] > shadow_epsilon && t[l] <= p->t[l]) {
+                        p->hit[l] = k;
+                        open -= 1;
+                    }
+                }
+            }
+            continue;
+        }
+        stack[top++] = node->left_first + 1;
+        stack[top++] = node->left_first;
+    }
+}
+
+#define SPECULAR_EXPONENT 20
+
+//x to a small non-negative integer power by repeated squaring; with a
+//constant n the loop unrolls into a handful of multiplies
+static inline real ipow(real x, int n) {
+    real result = 1;
+    while (n > 0) {
+        if (n & 1) {
+            result *= x;
+        }
+        x *= x;
+        n >>= 1;
+    }
+    return result;
+}
+
+//angular falloff of light j. In this shading model the spot term depends
+//only on the light's theta, direction and position, so it is the same for
+//every point the light reaches.
+real spot_factor(int j) {
+    real* L = lights[j]->light.direction;
+    real alpha = L[0] * lights[j]->center[0] 
+    + L[1] * lights[j]->center[1] 
+    + L[2] * lights[j]->center[2];
+    if (lights[j]->light.theta == 0){
+        return 1;
+    }else if (cos(lights[j]->light.theta) > cos(alpha)){
+        return 0;
+    }else{
+        return ipow(cos(alpha), SPECULAR_EXPONENT);
+    }
+}
+
+//Flat per-light record with everything shading needs, built once by
+//compile_lights() so the per-pixel loop does no per-light setup. direction
+//is kept as given: the reflection term uses it unnormalized.
+typedef struct {
+    real position[3];
+    real color[3];
+    real direction[3];
+    real radial[3];
+    real spot;
+} LightRecord;
+
+LightRecord* light_table;
+
+//Builds the light records and marks the lights whose spot term is zero,
+//which need no shadow rays at all.
+void compile_lights(void) {
+    light_table = malloc(sizeof(LightRecord) * (light_count + 1));
+    for (int j = 0; j < light_count; j += 1) {
+        LightRecord* light = &light_table[j];
+        memcpy(light->position, lights[j]->center, sizeof(real) * 3);
+        memcpy(light->color, lights[j]->color, sizeof(real) * 3);
+        memcpy(light->direction, lights[j]->light.direction, sizeof(real) * 3);
+        light->radial[0] = lights[j]->light.radial0;
+        light->radial[1] = lights[j]->light.radial1;
+        light->radial[2] = lights[j]->light.radial2;
+        light->spot = spot_factor(j);
+    }
+    real extent = 0;
+    for (int a = 0; a < 3; a += 1) {
+        if (bvh_node_count > 0) {
+            extent = fmax(extent, fmax(fabs(bvh_nodes[0].min[a]), fabs(bvh_nodes[0].max[a])));
+        }
+        for (int j = 0; j < light_count; j += 1) {
+            extent = fmax(extent, fabs(lights[j]->center[a]));
+        }
+    }
+    shadow_epsilon = RAY_EPSILON * (1 + extent);
+    light_active = malloc(light_count + 1);
+    for (int j = 0; j < light_count; j += 1) {
+        light_active[j] = light_table[j].spot != 0;
+    }
+}
+
+//Each thread remembers the object that last blocked a shadow ray toward
+//each of the first OCCLUDER_CACHE_LIGHTS lights (stored plus one, so zero
+//means empty). Neighbouring pixels are usually shadowed by the same object,
+//so it is tried before walking the BVH.
+#define OCCLUDER_CACHE_LIGHTS 64
+static _Thread_local int last_occluder[OCCLUDER_CACHE_LIGHTS];
+
+//shadow query for light j that tries this thread's cached occluder first
+static inline int light_blocked(real* Ro, real* Rd, real dl, int skip, int j) {
+    if (j < OCCLUDER_CACHE_LIGHTS) {
+        int k = last_occluder[j] - 1;
+        if (k >= 0 && k != skip && k < object_count) {
+            real t = object_intersection(objects[k], Ro, Rd);
+            if (t > shadow_epsilon && t <= dl) {
+                STAT_ADD(occluder_cache_hits, 1);
+                return 1;
+            }
+        }
+    }
+    int k = occluded(Ro, Rd, dl, skip);
+    if (k >= 0 && j < OCCLUDER_CACHE_LIGHTS) {
+        last_occluder[j] = k + 1;
+    }
+    return k >= 0;
+}
+
+//tries the cached occluder for light j against every live lane of a shadow
+//packet, marking the lanes it blocks
+static void packet_try_cached(RayPacket* p, int j) {
+    if (j >= OCCLUDER_CACHE_LIGHTS || last_occluder[j] == 0) {
+        return;
+    }
+    int k = last_occluder[j] - 1;
+    if (k >= object_count) {
+        return;
+    }
+    for (int l = 0; l < p->count; l += 1) {
+        if (p->t[l] < 0 || k == p->skip[l]) {
+            continue;
+        }
+        real Ro[3] = {p->ox[l], p->oy[l], p->oz[l]};
+        real Rd[3] = {p->dx[l], p->dy[l], p->dz[l]};
+        real t = object_intersection(objects[k], Ro, Rd);
+        if (t > shadow_epsilon && t <= p->t[l]) {
+            p->hit[l] = k;
+            STAT_ADD(occluder_cache_hits, 1);
+        }
+    }
+}
+
+//Post pass. Shading stores linear radiance in framebuffer, three floats
+//per pixel laid out like image, so nothing above 1.0 is lost until the
+//frame is written. 8-bit output then goes through tone_map(), which scales
+//by the exposure, applies the tone curve and quantizes a whole run of
+//floats at once. Every curve is the rational v(a v + b) / (v(c v + d) + e),
+//so the kernels run one branch-free formula whatever the curve: clamp is
+//v / 1, Reinhard v / (v + 1), and ACES the usual fit to the film curve.
+enum { TONE_CLAMP, TONE_REINHARD, TONE_ACES };
+static const float tone_curves[3][5] = {
+    {0, 1, 0, 0, 1},
+    {0, 1, 0, 1, 1},
+    {2.51f, 0.03f, 2.43f, 0.59f, 0.14f},
+};
+float exposure = 1;
+int tone_curve = TONE_CLAMP;
+
+//tone maps n floats of in to 8-bit values in out
+static void tone_map_scalar(const float* in, unsigned char* out, long n) {
+    const float* k = tone_curves[tone_curve];
+    for (long i = 0; i < n; i += 1) {
+        float v = in[i] * exposure;
+        v = v > 0 ? v : 0;
+        v = v * (k[0] * v + k[1]) / (v * (k[2] * v + k[3]) + k[4]);
+        v = v < 1 ? v : 1;
+        out[i] = (unsigned char)(v * MAXCOLOR);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx")))
+static inline __m256 tone_map_curve(__m256 v, const float* k) {
+    v = _mm256_max_ps(v, _mm256_setzero_ps());
+    __m256 num = _mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(k[0]), v), _mm256_set1_ps(k[1])));
+    __m256 den = _mm256_add_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(k[2]), v),
+            _mm256_set1_ps(k[3]))), _mm256_set1_ps(k[4]));
+    v = _mm256_min_ps(_mm256_div_ps(num, den), _mm256_set1_ps(1));
+    return _mm256_mul_ps(v, _mm256_set1_ps(MAXCOLOR));
+}
+
+//16 floats per step: truncate to int32, then narrow with saturating packs
+__attribute__((target("avx")))
+static void tone_map_avx(const float* in, unsigned char* out, long n) {
+    const float* k = tone_curves[tone_curve];
+    __m256 scale = _mm256_set1_ps(exposure);
+    long i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cvttps_epi32(tone_map_curve(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), k));
+        __m256i b = _mm256_cvttps_epi32(tone_map_curve(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), k));
+        __m128i lo = _mm_packs_epi32(_mm256_castsi256_si128(a), _mm256_extractf128_si256(a, 1));
+        __m128i hi = _mm_packs_epi32(_mm256_castsi256_si128(b), _mm256_extractf128_si256(b, 1));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+    }
+    tone_map_scalar(in + i, out + i, n - i);
+}
+#endif
+
+void (*tone_map)(const float* in, unsigned char* out, long n) = tone_map_scalar;
+
+//picks the widest kernels the CPU supports unless scalar is forced
+void select_kernels(int force_scalar) {
+    sphere_kernel = sphere_kernel_scalar;
+    plane_kernel = plane_kernel_scalar;
+    sphere_packet = sphere_packet_scalar;
+    tone_map = tone_map_scalar;
+    if (force_scalar) {
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        sphere_kernel = sphere_kernel_avx;
+        plane_kernel = plane_kernel_avx;
+        sphere_packet = sphere_packet_avx;
+        tone_map = tone_map_avx;
+    } else if (__builtin_cpu_supports("sse2")) {
+        sphere_kernel = sphere_kernel_sse;
+    }
+#endif
+}
+
+//Scene loading reports an error and exits, unless a render server has armed
+//scene_recover to turn the error into one failed request instead. It is
+//per thread, since a jump cannot cross threads.
+_Thread_local jmp_buf* scene_recover;
+
+static void scene_fail(void) {
+    if (scene_recover != NULL) {
+        longjmp(*scene_recover, 1);
+    }
+    exit(1);
+}
+
+//Bump allocator that owns everything read_scene produces: the objects and
+//lights, the lists pointing at them, keys and vectors. Memory comes in
+//chained blocks so growing never moves earlier allocations, and
+//arena_free() gives the whole scene back at once.
+#define ARENA_BLOCK (1 << 20)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+Arena scene_arena;
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Error: Out of memory while reading the scene.\n");
+            scene_fail();
+        }
+        block->used = 0;
+        block->size = block_size;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void* p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+void arena_free(Arena* arena) {
+    while (arena->head != NULL) {
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+//appends o to a NULL-terminated object list, doubling it inside the arena
+//when it is full. The old copy is simply left behind.
+static Object** list_append(Arena* arena, Object** list, int* count, int* capacity, Object* o) {
+    if (*count + 1 >= *capacity) {
+        Object** grown = arena_alloc(arena, sizeof(Object*) * *capacity * 2);
+        memcpy(grown, list, sizeof(Object*) * *count);
+        list = grown;
+        *capacity *= 2;
+    }
+    list[(*count)++] = o;
+    list[*count] = NULL;
+    return list;
+}
+
+//The scene file is mapped into memory and parsed in one pass over the
+//buffer; pos is the read cursor and end is one past the last byte.
+typedef struct {
+  const char* pos;
+  const char* end;
+  const char* base;
+  size_t size;
+} Json;
+
+//Every key and type name the parser understands, interned once so the
+//field dispatch below is a switch instead of a strcmp chain.
+enum {
+  KEY_UNKNOWN,
+  KEY_TYPE,
+  KEY_CAMERA,
+  KEY_SPHERE,
+  KEY_PLANE,
+  KEY_LIGHT,
+  KEY_WIDTH,
+  KEY_HEIGHT,
+  KEY_RADIUS,
+  KEY_COLOR,
+  KEY_POSITION,
+  KEY_NORMAL,
+  KEY_DIFFUSE_COLOR,
+  KEY_SPECULAR_COLOR,
+  KEY_DIRECTION,
+  KEY_RADIAL_A2,
+  KEY_RADIAL_A1,
+  KEY_RADIAL_A0,
+  KEY_ANGULAR_A0,
+  KEY_THETA,
+  KEY_CHUNKS
+};
+
+//maps a string to its key id, switching on the first character so at most
+//a couple of comparisons are made
+int intern_key(const char* s) {
+  switch (s[0]) {
+    case 'a':
+      if (strcmp(s, "angular-a0") == 0) return KEY_ANGULAR_A0;
+      break;
+    case 'c':
+      if (strcmp(s, "color") == 0) return KEY_COLOR;
+      if (strcmp(s, "camera") == 0) return KEY_CAMERA;
+      if (strcmp(s, "chunks") == 0) return KEY_CHUNKS;
+      break;
+    case 'd':
+      if (strcmp(s, "diffuse_color") == 0) return KEY_DIFFUSE_COLOR;
+      if (strcmp(s, "direction") == 0) return KEY_DIRECTION;
+      break;
+    case 'h':
+      if (strcmp(s, "height") == 0) return KEY_HEIGHT;
+      break;
+    case 'l':
+      if (strcmp(s, "light") == 0) return KEY_LIGHT;
+      break;
+    case 'n':
+      if (strcmp(s, "normal") == 0) return KEY_NORMAL;
+      break;
+    case 'p':
+      if (strcmp(s, "position") == 0) return KEY_POSITION;
+      if (strcmp(s, "plane") == 0) return KEY_PLANE;
+      break;
+    case 'r':
+      if (strncmp(s, "radial-a", 8) == 0 && s[9] == 0) {
+        if (s[8] == '2') return KEY_RADIAL_A2;
+        if (s[8] == '1') return KEY_RADIAL_A1;
+        if (s[8] == '0') return KEY_RADIAL_A0;
+      }
+      if (strcmp(s, "radius") == 0) return KEY_RADIUS;
+      break;
+    case 's':
+      if (strcmp(s, "sphere") == 0) return KEY_SPHERE;
+      if (strcmp(s, "specular_color") == 0) return KEY_SPECULAR_COLOR;
+      break;
+    case 't':
+      if (strcmp(s, "type") == 0) return KEY_TYPE;
+      if (strcmp(s, "theta") == 0) return KEY_THETA;
+      break;
+    case 'w':
+      if (strcmp(s, "width") == 0) return KEY_WIDTH;
+      break;
+  }
+  return KEY_UNKNOWN;
+}
+
+// next_c() reads the next character of the buffer and provides error
+// checking and line number maintenance
+int next_c(Json* json) {
+  if (json->pos >= json->end) {
+    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+    scene_fail();
+  }
+  int c = *json->pos++;
+
+  if (c == '\n') {
+    line += 1;
+  }
+  return c;
+}
+
+// next_string() reads the next string into buffer (which must hold 129
+// characters) and returns its interned key id. It emits an error if a string
+// can not be obtained.
+int next_string(Json* json, char* buffer) {
+  int c = next_c(json);
+  if (c != '"') {
+    fprintf(stderr, "Error: Expected string on line %d.\n", line);
+    scene_fail();
+  }  
+  c = next_c(json);
+  int i = 0;
+  while (c != '"') {
+    if (i >= 128) {
+      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
+      scene_fail();      
+    }
+    if (c == '\\') {
+      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
+      scene_fail();      
+    }
+    if (c < 32 || c > 126) {
+      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
+      scene_fail();
+    }
+    buffer[i] = c;
+    i += 1;
+    c = next_c(json);
+  }
+  buffer[i] = 0;
+  return intern_key(buffer);
+}
+
+// expect_c() checks that the next character is d.  If it is not it emits
+// an error.
+void expect_c(Json* json, int d) {
+  int c = next_c(json);
+  if (c == d) return;
+  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
+  scene_fail();    
+}
+
+
+// skip_ws() skips white space in the buffer. With SSE2 it classifies 16
+// bytes per step and counts the newlines it passes with a popcount.
+void skip_ws(Json* json) {
+#ifdef __SSE2__
+  while (json->end - json->pos >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)json->pos);
+    __m128i nl = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'));
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), nl);
+    //'\t' '\v' '\f' '\r' are the run 9..13
+    __m128i ctl = _mm_cmplt_epi8(_mm_sub_epi8(chunk, _mm_set1_epi8(9)), _mm_set1_epi8(5));
+    ctl = _mm_and_si128(ctl, _mm_cmpgt_epi8(chunk, _mm_set1_epi8(8)));
+    ws = _mm_or_si128(ws, ctl);
+    unsigned stop = ~(unsigned)_mm_movemask_epi8(ws) & 0xFFFF;
+    unsigned newlines = (unsigned)_mm_movemask_epi8(nl);
+    if (stop == 0) {
+      line += __builtin_popcount(newlines);
+      json->pos += 16;
+      continue;
+    }
+    int n = __builtin_ctz(stop);
+    line += __builtin_popcount(newlines & ((1u << n) - 1));
+    json->pos += n;
+    return;
+  }
+#endif
+  while (json->pos < json->end && isspace((unsigned char)*json->pos)) {
+    if (*json->pos == '\n') {
+      line += 1;
+    }
+    json->pos += 1;
+  }
+  if (json->pos >= json->end) {
+    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+    scene_fail();
+  }
+}
+
+
+// next_number() converts the number under the cursor. The token is copied
+// out first because the mapped buffer is not NUL terminated.
+real next_number(Json* json) {
+  char buffer[64];
+  int n = 0;
+  skip_ws(json);
+  while (json->pos < json->end && n < 63 &&
+         (isdigit((unsigned char)*json->pos) || strchr("+-.eE", *json->pos) != NULL)) {
+    buffer[n++] = *json->pos++;
+  }
+  buffer[n] = 0;
+  char* stop;
+  real value = strtod(buffer, &stop);
+  if (n == 0 || stop == buffer){
+      fprintf(stderr,"Number value not found on line %d.", line);
+      return -1;
+  }
+  json->pos -= (buffer + n) - stop;
+  return value;
+}
+
+void next_vector(Json* json, real* v) {
+  expect_c(json, '[');
+  skip_ws(json);
+  v[0] = next_number(json);
+  skip_ws(json);
+  expect_c(json, ',');
+  skip_ws(json);
+  v[1] = next_number(json);
+  skip_ws(json);
+  expect_c(json, ',');
+  skip_ws(json);
+  v[2] = next_number(json);
+  skip_ws(json);
+  expect_c(json, ']');
+}
+
+//set camera view
+void set_camera(Json* json, Object* camera){
+    int c;
+    char key[129];
+    skip_ws(json);
+    camera->center[0] = 0;
+    camera->center[1] = 0;
+    camera->center[2] = 0;
+      while (1) {
+	// , }
+	c = next_c(json);
+        
+	if (c == '}') {
+	  // stop parsing this object
+	  break;
+	} else if (c == ',') {
+            
+	  // read another field
+	  skip_ws(json);
+	  int id = next_string(json, key);
+	  skip_ws(json);
+	  expect_c(json, ':');
+	  skip_ws(json);
+          real value = next_number(json);
+          switch (id) {
+            case KEY_WIDTH:
+              camera->camera.width = value;
+              break;
+            case KEY_HEIGHT:
+              camera->camera.height = value;
+              break;
+            default:
+	      fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
+		      key, line);
+              scene_fail();
+	  }
+        }
+      }
+}
+
+//copies a parsed vector into dst
+static inline void set_vector(real* dst, real* v) {
+  dst[0] = v[0];
+  dst[1] = v[1];
+  dst[2] = v[2];
+}
+
+//What one parse produces: the objects and lights it read, allocated in its
+//own arena, and the camera if it met one.
+typedef struct {
+  Arena* arena;
+  Object** objects;
+  Object** lights;
+  int object_count;
+  int light_count;
+  int object_capacity;
+  int light_capacity;
+  Object camera;
+  int has_camera;
+} SceneParse;
+
+//parses a whole scene held in memory into ps, allocating from arena
+void parse_scene(Json* json, SceneParse* ps, Arena* arena) {
+  int c;
+  char key[129];
+  char value[129];
+  line = 1;
+  
+  skip_ws(json);
+  
+  // Find the beginning of the list
+  expect_c(json, '[');
+  skip_ws(json);
+
+  // Find the objects
+  memset(ps, 0, sizeof(SceneParse));
+  ps->arena = arena;
+  ps->object_capacity = 16;
+  ps->light_capacity = 16;
+  ps->objects = arena_alloc(arena, sizeof(Object*) * ps->object_capacity);
+  ps->lights = arena_alloc(arena, sizeof(Object*) * ps->light_capacity);
+  ps->objects[0] = NULL;
+  ps->lights[0] = NULL;
+  while (1) {
+    c = next_c(json);
+    if (c == ']') {
+      fprintf(stderr, "Error: This is the worst scene file EVER.\n");
+      break;
+    }
+    if (c == '{') {
+      skip_ws(json);
+    
+      // Parse the object
+      if (next_string(json, key) != KEY_TYPE) {
+	fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
+	scene_fail();
+      }
+
+      skip_ws(json);
+
+      expect_c(json, ':');
+
+      skip_ws(json);
+
+      int type = next_string(json, value);
+      
+      //Sets value of the object or arranges the camera
+      Object* current = NULL;
+      switch (type) {
+        case KEY_CAMERA:
+          set_camera(json, &ps->camera);
+          ps->has_camera = 1;
+          break;
+        case KEY_SPHERE:
+        case KEY_PLANE:
+        case KEY_LIGHT:
+          current = arena_alloc(arena, sizeof(Object));
+          memset(current, 0, sizeof(Object));
+          current->kind = type == KEY_SPHERE ? 1 : type == KEY_PLANE ? 0 : 2;
+          break;
+        default:
+	  fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
+	  scene_fail();
+      }
+
+      skip_ws(json);
+      //Makes sure we skip the object if it is the camera because of the function set_camera
+      if (current != NULL){
+        while (1) {
+          // , }
+          c = next_c(json);
+
+          if (c == '}') {
+            // stop parsing this object
+            break;
+          } else if (c == ',') {
+              
+            // read another field
+            skip_ws(json);
+            int id = next_string(json, key);
+            skip_ws(json);
+            expect_c(json, ':');
+            skip_ws(json);
+            
+            real number;
+            real v[3];
+            switch (id) {
+              //sets radius
+              case KEY_RADIUS:
+                number = next_number(json);
+                if(current->kind == 1){
+                    current->sphere.radius = number;
+                }else{
+                    fprintf(stderr, "Radius should only to attached to a sphere.");
+                }
+                break;
+
+              //Checks for position,color, and normal fields
+              case KEY_COLOR:
+              case KEY_POSITION:
+              case KEY_NORMAL:
+              case KEY_DIFFUSE_COLOR:
+              case KEY_SPECULAR_COLOR:
+              case KEY_DIRECTION:
+                next_vector(json, v);
+                if(current->kind == 1){
+                    //sets position and color for sphere
+                    switch (id) {
+                      case KEY_POSITION:
+                        current->center[0] = v[0];
+                        current->center[1] = -v[1];
+                        current->center[2] = v[2];
+                        break;
+                      case KEY_COLOR:
+                        set_vector(current->color, v);
+                        break;
+                      case KEY_DIFFUSE_COLOR:
+                        set_vector(current->sphere.difuse_color, v);
+                        break;
+                      case KEY_SPECULAR_COLOR:
+                        set_vector(current->sphere.specular_color, v);
+                        break;
+                      default:
+                        fprintf(stderr, "Non-valid field entered for a sphere");
+                        scene_fail();
+                    }
+                }else if(current->kind == 0){
+                    //sets position and color for plane
+                    switch (id) {
+                      case KEY_POSITION:
+                        set_vector(current->center, v);
+                        break;
+                      case KEY_COLOR:
+                        set_vector(current->color, v);
+                        break;
+                      case KEY_NORMAL:
+                        set_vector(current->plane.normal, v);
+                        break;
+                      case KEY_DIFFUSE_COLOR:
+                        set_vector(current->plane.difuse_color, v);
+                        break;
+                      case KEY_SPECULAR_COLOR:
+                        set_vector(current->plane.specular_color, v);
+                        break;
+                      default:
+                        fprintf(stderr, "Non-valid field entered for a plane");
+                        scene_fail();
+                    }
+                }else{
+                    switch (id) {
+                      case KEY_POSITION:
+                        set_vector(current->center, v);
+                        break;
+                      case KEY_COLOR:
+                        set_vector(current->color, v);
+                        break;
+                      case KEY_DIRECTION:
+                        set_vector(current->light.direction, v);
+                        break;
+                      default:
+                        fprintf(stderr, "Non-valid field entered for a light");
+                        scene_fail();
+                    }
+                }
+                break;
+
+              case KEY_RADIAL_A2:
+              case KEY_RADIAL_A1:
+              case KEY_RADIAL_A0:
+              case KEY_ANGULAR_A0:
+              case KEY_THETA:
+                number = next_number(json);
+                if(current->kind == 2){
+                    switch (id) {
+                      case KEY_RADIAL_A2:
+                        current->light.radial2 = number;
+                        break;
+                      case KEY_RADIAL_A1:
+                        current->light.radial1 = number;
+                        break;
+                      case KEY_RADIAL_A0:
+                        current->light.radial0 = number;
+                        break;
+                      case KEY_ANGULAR_A0:
+                        current->light.angular0 = number;
+                        break;
+                      default:
+                        current->light.theta = number;
+                    }
+                }
+                break;
+
+              default:
+                fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
+                        key, line);
+            }
+            skip_ws(json);
+          } else {
+            fprintf(stderr, "Error: Unexpected value on line %d\n", line);
+            scene_fail();
+          }
+        }
+        //lights and renderable objects are kept in separate lists
+        if (current->kind == 2) {
+            ps->lights = list_append(arena, ps->lights, &ps->light_count, &ps->light_capacity, current);
+        } else {
+            ps->objects = list_append(arena, ps->objects, &ps->object_count, &ps->object_capacity, current);
+        }
+      }
+      
+      skip_ws(json);
+      c = next_c(json);
+      if (c == ',') {
+	// noop
+	skip_ws(json);
+      } else if (c == ']') {
+	break;
+      } else {
+	fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+	scene_fail();
+      }
+    }
+  }
+}
+
+//makes what a parse produced the current scene. The lists already live in
+//scene_arena; a scene without a camera keeps the previous one.
+void use_parsed_scene(SceneParse* ps) {
+  objects = ps->objects;
+  lights = ps->lights;
+  object_count = ps->object_count;
+  light_count = ps->light_count;
+  if (ps->has_camera) {
+    camera = ps->camera;
+  }
+}
+
+//the JSON file read_scene has mapped, so a failed load can still unmap it
+const char* json_map;
+size_t json_map_size;
+
+//maps filename read-only into json; an empty file gets an empty buffer.
+//Returns 0 if the file cannot be opened.
+static int map_json(const char* filename, Json* json) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  json->size = st.st_size;
+  json->base = "";
+  if (json->size > 0) {
+    json->base = mmap(NULL, json->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (json->base == MAP_FAILED) {
+      close(fd);
+      return 0;
+    }
+    madvise((void*)json->base, json->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  json->pos = json->base;
+  json->end = json->base + json->size;
+  return 1;
+}
+
+//A chunked scene is a manifest, {"chunks": ["a.json", "b.json"]}, naming
+//ordinary scene files that are parsed on separate threads. Each chunk gets
+//its own arena, so the parsers share nothing; afterwards the arenas are
+//spliced into scene_arena and the lists joined in manifest order, which
+//gives the same scene as one file holding the chunks back to back. Relative
+//chunk paths are taken from the manifest's directory. The camera comes from
+//the first chunk that has one.
+#define CHUNK_PATH 4096
+
+typedef struct {
+  char path[CHUNK_PATH];
+  Arena arena;
+  SceneParse parse;
+  const char* map;
+  size_t map_size;
+  int failed;
+} SceneChunk;
+
+typedef struct {
+  SceneChunk* chunks;
+  int count;
+  atomic_int next;
+} ChunkQueue;
+
+//parses chunks until none are left. A bad chunk is unmapped and marked
+//failed here; reporting it is left to the thread that started the load.
+static void* chunk_worker(void* arg) {
+  ChunkQueue* queue = arg;
+  jmp_buf* outer = scene_recover;
+  while (1) {
+    int i = atomic_fetch_add(&queue->next, 1);
+    if (i >= queue->count) break;
+    SceneChunk* chunk = &queue->chunks[i];
+    jmp_buf recover;
+    if (setjmp(recover) != 0) {
+      if (chunk->map != NULL) {
+        munmap((void*)chunk->map, chunk->map_size);
+        chunk->map = NULL;
+      }
+      chunk->failed = 1;
+      continue;
+    }
+    scene_recover = &recover;
+    Json json;
+    if (!map_json(chunk->path, &json)) {
+      fprintf(stderr, "Error: Could not open file \"%s\"\n", chunk->path);
+      scene_fail();
+    }
+    chunk->map = json.size > 0 ? json.base : NULL;
+    chunk->map_size = json.size;
+    parse_scene(&json, &chunk->parse, &chunk->arena);
+    if (chunk->map != NULL) {
+      munmap((void*)chunk->map, chunk->map_size);
+      chunk->map = NULL;
+    }
+  }
+  scene_recover = outer;
+  return NULL;
+}
+
+//moves every block of src into dst; src is left empty
+static void arena_splice(Arena* dst, Arena* src) {
+  if (src->head == NULL) return;
+  ArenaBlock* tail = src->head;
+  while (tail->next != NULL) {
+    tail = tail->next;
+  }
+  if (dst->head == NULL) {
+    dst->head = src->head;
+  } else {
+    //behind dst's head, so dst keeps bumping its current block
+    tail->next = dst->head->next;
+    dst->head->next = src->head;
+  }
+  src->head = NULL;
+}
+
+//reads the chunk list of a manifest whose '{' has been consumed into
+//arena and returns it, with each path resolved against the manifest's
+//directory
+static SceneChunk* read_chunk_list(Json* json, const char* filename, Arena* arena, int* chunk_count) {
+  char key[129];
+  skip_ws(json);
+  if (next_string(json, key) != KEY_CHUNKS) {
+    fprintf(stderr, "Error: Expected \"chunks\" key on line number %d.\n", line);
+    scene_fail();
+  }
+  skip_ws(json);
+  expect_c(json, ':');
+  skip_ws(json);
+  expect_c(json, '[');
+  skip_ws(json);
+
+  const char* slash = strrchr(filename, '/');
+  int dir_length = slash != NULL ? (int)(slash - filename) + 1 : 0;
+  int count = 0;
+  int capacity = 16;
+  SceneChunk* chunks = arena_alloc(arena, sizeof(SceneChunk) * capacity);
+  while (json->pos < json->end && *json->pos != ']') {
+    if (count == capacity) {
+      SceneChunk* grown = arena_alloc(arena, sizeof(SceneChunk) * capacity * 2);
+      memcpy(grown, chunks, sizeof(SceneChunk) * count);
+      chunks = grown;
+      capacity *= 2;
+    }
+    SceneChunk* chunk = &chunks[count];
+    memset(chunk, 0, sizeof(SceneChunk));
+    next_string(json, key);
+    snprintf(chunk->path, CHUNK_PATH, "%.*s%s", key[0] == '/' ? 0 : dir_length, filename, key);
+    count += 1;
+    skip_ws(json);
+    if (json->pos < json->end && *json->pos == ',') {
+      next_c(json);
+      skip_ws(json);
+    }
+  }
+  expect_c(json, ']');
+  skip_ws(json);
+  expect_c(json, '}');
+  if (count == 0) {
+    fprintf(stderr, "Error: The manifest lists no chunks.\n");
+    scene_fail();
+  }
+  *chunk_count = count;
+  return chunks;
+}
+
+//reads the chunk list of a manifest whose '{' has been consumed, then
+//parses the chunks in parallel and merges them into the current scene
+static void read_chunks(Json* json, const char* filename) {
+  int count;
+  SceneChunk* chunks = read_chunk_list(json, filename, &scene_arena, &count);
+  ChunkQueue queue;
+  queue.chunks = chunks;
+  queue.count = count;
+  atomic_init(&queue.next, 0);
+  int workers = num_threads < count ? num_threads : count;
+  pthread_t threads[MAX_THREADS];
+  int started = 0;
+  for (int t = 1; t < workers; t += 1) {
+    if (pthread_create(&threads[started], NULL, chunk_worker, &queue) == 0) {
+      started += 1;
+    }
+  }
+  chunk_worker(&queue);
+  for (int t = 0; t < started; t += 1) {
+    pthread_join(threads[t], NULL);
+  }
+
+  int failed = 0;
+  int total_objects = 0;
+  int total_lights = 0;
+  for (int i = 0; i < count; i += 1) {
+    failed |= chunks[i].failed;
+    total_objects += chunks[i].parse.object_count;
+    total_lights += chunks[i].parse.light_count;
+  }
+  if (failed) {
+    for (int i = 0; i < count; i += 1) {
+      if (chunks[i].failed) {
+        fprintf(stderr, "Error: Could not load chunk \"%s\".\n", chunks[i].path);
+      }
+      arena_free(&chunks[i].arena);
+    }
+    scene_fail();
+  }
+
+  SceneParse merged;
+  memset(&merged, 0, sizeof(merged));
+  merged.objects = arena_alloc(&scene_arena, sizeof(Object*) * (total_objects + 1));
+  merged.lights = arena_alloc(&scene_arena, sizeof(Object*) * (total_lights + 1));
+  for (int i = 0; i < count; i += 1) {
+    SceneParse* ps = &chunks[i].parse;
+    memcpy(merged.objects + merged.object_count, ps->objects, sizeof(Object*) * ps->object_count);
+    memcpy(merged.lights + merged.light_count, ps->lights, sizeof(Object*) * ps->light_count);
+    merged.object_count += ps->object_count;
+    merged.light_count += ps->light_count;
+    if (ps->has_camera && !merged.has_camera) {
+      merged.camera = ps->camera;
+      merged.has_camera = 1;
+    }
+    arena_splice(&scene_arena, &chunks[i].arena);
+  }
+  merged.objects[merged.object_count] = NULL;
+  merged.lights[merged.light_count] = NULL;
+  use_parsed_scene(&merged);
+}
+
+//begins the parsing of the file: a scene array, or a manifest of chunks
+void read_scene(char* filename) {
+  Json file;
+  if (!map_json(filename, &file)) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    scene_fail();
+  }
+  json_map = file.size > 0 ? file.base : NULL;
+  json_map_size = file.size;
+  line = 1;
+  skip_ws(&file);
+  if (file.pos < file.end && *file.pos == '{') {
+    next_c(&file);
+    read_chunks(&file, filename);
+  } else {
+    SceneParse ps;
+    file.pos = file.base;
+    parse_scene(&file, &ps, &scene_arena);
+    use_parsed_scene(&ps);
+  }
+  if (json_map != NULL) {
+    munmap((void*)json_map, json_map_size);
+    json_map = NULL;
+  }
+}
+
+//Compiled binary scene. Everything after the header is a copy of the
+//renderer's own in-memory arrays (Object records, BVH nodes, the packed
+//SoA stores and the material table), each section aligned to 64 bytes, so
+//loading is a single mmap and the renderer points straight into the mapping.
+//Values are stored in the host's little-endian layout; the header records
+//the version and the record sizes so a file from a different build is
+//rejected.
+#define SCENE_MAGIC "RAYSCENE"
+#define SCENE_VERSION 2
+#define SCENE_ALIGN 64
+
+enum {
+  SECTION_OBJECTS,
+  SECTION_LIGHTS,
+  SECTION_NODES,
+  SECTION_SPHERE_X,
+  SECTION_SPHERE_Y,
+  SECTION_SPHERE_Z,
+  SECTION_SPHERE_R2,
+  SECTION_SPHERE_ID,
+  SECTION_PLANE_NX,
+  SECTION_PLANE_NY,
+  SECTION_PLANE_NZ,
+  SECTION_PLANE_D,
+  SECTION_PLANE_ID,
+  SECTION_MATERIALS,
+  SECTION_COUNT
+};
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t object_size;
+  uint32_t node_size;
+  uint32_t object_count;
+  uint32_t light_count;
+  uint32_t sphere_count;
+  uint32_t plane_count;
+  uint32_t node_count;
+  uint32_t reserved;
+  Object camera;
+  uint64_t offset[SECTION_COUNT];
+} SceneHeader;
+
+//writes count bytes at the next aligned offset and records where they went
+static void write_section(FILE* out, SceneHeader* header, int section, const void* data, size_t count) {
+  static const char zeros[SCENE_ALIGN];
+  long pos = ftell(out);
+  long pad = (SCENE_ALIGN - pos % SCENE_ALIGN) % SCENE_ALIGN;
+  fwrite(zeros, 1, pad, out);
+  header->offset[section] = pos + pad;
+  if (count > 0 && fwrite(data, 1, count, out) != count) {
+    fprintf(stderr, "Error: Could not write the compiled scene.\n");
+    scene_fail();
+  }
+}
+
+//writes the current, already compiled, scene to filename
+void write_binary_scene(char* filename) {
+  FILE* out = fopen(filename, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    scene_fail();
+  }
+  SceneHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_MAGIC, 8);
+  header.version = SCENE_VERSION;
+  header.byte_order = 0x01020304;
+  header.object_size = sizeof(Object);
+  header.node_size = sizeof(BVHNode);
+  header.object_count = object_count;
+  header.light_count = light_count;
+  header.sphere_count = spheres.count;
+  header.plane_count = planes.count;
+  header.node_count = bvh_node_count;
+  header.camera = camera;
+  fwrite(&header, sizeof(header), 1, out);
+
+  //the object lists hold pointers, so the records are gathered one by one
+  write_section(out, &header, SECTION_OBJECTS, NULL, 0);
+  for (int i = 0; i < object_count; i += 1) {
+    fwrite(objects[i], sizeof(Object), 1, out);
+  }
+  write_section(out, &header, SECTION_LIGHTS, NULL, 0);
+  for (int j = 0; j < light_count; j += 1) {
+    fwrite(lights[j], sizeof(Object), 1, out);
+  }
+  size_t sphere_bytes = sizeof(real) * (spheres.count + SIMD_WIDTH);
+  size_t plane_bytes = sizeof(real) * (planes.count + SIMD_WIDTH);
+  write_section(out, &header, SECTION_NODES, bvh_nodes, sizeof(BVHNode) * bvh_node_count);
+  write_section(out, &header, SECTION_SPHERE_X, spheres.x, sphere_bytes);
+  write_section(out, &header, SECTION_SPHERE_Y, spheres.y, sphere_bytes);
+  write_section(out, &header, SECTION_SPHERE_Z, spheres.z, sphere_bytes);
+  write_section(out, &header, SECTION_SPHERE_R2, spheres.r2, sphere_bytes);
+  write_section(out, &header, SECTION_SPHERE_ID, spheres.id, sizeof(int) * spheres.count);
+  write_section(out, &header, SECTION_PLANE_NX, planes.nx, plane_bytes);
+  write_section(out, &header, SECTION_PLANE_NY, planes.ny, plane_bytes);
+  write_section(out, &header, SECTION_PLANE_NZ, planes.nz, plane_bytes);
+  write_section(out, &header, SECTION_PLANE_D, planes.d, plane_bytes);
+  write_section(out, &header, SECTION_PLANE_ID, planes.id, sizeof(int) * planes.count);
+  write_section(out, &header, SECTION_MATERIALS, materials, sizeof(Material) * object_count);
+
+  fseek(out, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, out);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Error: Could not write the compiled scene.\n");
+    scene_fail();
+  }
+}
+
+//the compiled scene currently mapped, if any
+char* scene_map;
+size_t scene_map_size;
+
+//bytes each section of a compiled scene holds, from the header's counts;
+//the counts are 32-bit, so none of these products can overflow
+static uint64_t section_size(SceneHeader* header, int section) {
+  uint64_t spheres_padded = (uint64_t)header->sphere_count + SIMD_WIDTH;
+  uint64_t planes_padded = (uint64_t)header->plane_count + SIMD_WIDTH;
+  switch (section) {
+  case SECTION_OBJECTS: return (uint64_t)header->object_count * sizeof(Object);
+  case SECTION_LIGHTS: return (uint64_t)header->light_count * sizeof(Object);
+  case SECTION_NODES: return (uint64_t)header->node_count * sizeof(BVHNode);
+  case SECTION_SPHERE_ID: return (uint64_t)header->sphere_count * sizeof(int);
+  case SECTION_PLANE_ID: return (uint64_t)header->plane_count * sizeof(int);
+  case SECTION_MATERIALS: return (uint64_t)header->object_count * sizeof(Material);
+  case SECTION_PLANE_NX: case SECTION_PLANE_NY: case SECTION_PLANE_NZ: case SECTION_PLANE_D:
+    return planes_padded * sizeof(real);
+  default: return spheres_padded * sizeof(real);
+  }
+}
+
+//true if each of the count ids is an object of the given kind that no
+//earlier id has named; seen marks the objects named so far
+static int check_ids(int* id, uint32_t count, Object* records, uint32_t objects_total, int kind, char* seen) {
+  for (uint32_t i = 0; i < count; i += 1) {
+    if (id[i] < 0 || (uint32_t)id[i] >= objects_total || records[id[i]].kind != kind || seen[id[i]]) {
+      return 0;
+    }
+    seen[id[i]] = 1;
+  }
+  return 1;
+}
+
+//checks that every object and light record has a kind its list can hold,
+//that the sphere and plane stores name every object once and only as its
+//own kind, that every index stored in the mapped sections stays inside the
+//arrays it points into, and that the BVH is a tree no deeper than the
+//traversal stacks allow; returns 0 if anything is out of range
+static int check_binary_scene(SceneHeader* header) {
+  uint32_t objects_total = header->object_count;
+  if (objects_total > INT_MAX - 1 || header->light_count > INT_MAX - 1 ||
+      header->node_count > INT_MAX || (uint64_t)header->sphere_count + header->plane_count != objects_total) {
+    return 0;
+  }
+  char* base = (char*)header;
+  Object* records = (Object*)(base + header->offset[SECTION_OBJECTS]);
+  Object* light_records = (Object*)(base + header->offset[SECTION_LIGHTS]);
+  for (uint32_t j = 0; j < header->light_count; j += 1) {
+    if (light_records[j].kind != 2) {
+      return 0;
+    }
+  }
+  //with the counts adding up, naming every object once also means no
+  //object is left out, so a record of any other kind fails here too
+  char* seen = calloc(objects_total + 1, 1);
+  int* sphere_id = (int*)(base + header->offset[SECTION_SPHERE_ID]);
+  int* plane_id = (int*)(base + header->offset[SECTION_PLANE_ID]);
+  int named = check_ids(sphere_id, header->sphere_count, records, objects_total, 1, seen) &&
+              check_ids(plane_id, header->plane_count, records, objects_total, 0, seen);
+  free(seen);
+  if (!named) {
+    return 0;
+  }
+  //children always come after their parent, so one forward pass settles
+  //every node's depth before its children are looked at
+  BVHNode* nodes = (BVHNode*)(base + header->offset[SECTION_NODES]);
+  int* depth = calloc(header->node_count + 1, sizeof(int));
+  int ok = 1;
+  for (uint32_t n = 0; n < header->node_count && ok; n += 1) {
+    BVHNode* node = &nodes[n];
+    if (node->count > 0) {
+      ok = node->left_first >= 0 && (uint32_t)node->left_first <= header->sphere_count &&
+           (uint32_t)node->count <= header->sphere_count - node->left_first;
+    } else {
+      ok = node->count == 0 && node->left_first > (int)n &&
+           (uint32_t)node->left_first < header->node_count - 1 && depth[n] < BVH_MAX_DEPTH;
+      for (int c = 0; ok && c < 2; c += 1) {
+        if (depth[node->left_first + c] < depth[n] + 1) {
+          depth[node->left_first + c] = depth[n] + 1;
+        }
+      }
+    }
+  }
+  free(depth);
+  return ok;
+}
+
+//maps a compiled scene and points the renderer's arrays into it. Returns 0
+//if the file is not a compiled scene at all.
+int map_binary_scene(char* filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    scene_fail();
+  }
+  char magic[8];
+  if (st.st_size < (off_t)sizeof(SceneHeader) || pread(fd, magic, 8, 0) != 8 ||
+      memcmp(magic, SCENE_MAGIC, 8) != 0) {
+    close(fd);
+    return 0;
+  }
+  //writable private pages so batch edits can move objects in place
+  char* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    scene_fail();
+  }
+  scene_map = base;
+  scene_map_size = st.st_size;
+  SceneHeader* header = (SceneHeader*)base;
+  if (header->version != SCENE_VERSION || header->byte_order != 0x01020304 ||
+      header->object_size != sizeof(Object) || header->node_size != sizeof(BVHNode)) {
+    fprintf(stderr, "Error: \"%s\" was compiled by an incompatible version of the renderer.\n", filename);
+    scene_fail();
+  }
+  for (int s = 0; s < SECTION_COUNT; s += 1) {
+    uint64_t offset = header->offset[s];
+    if (offset % SCENE_ALIGN != 0 || offset < sizeof(SceneHeader) || offset > (uint64_t)st.st_size ||
+        section_size(header, s) > (uint64_t)st.st_size - offset) {
+      fprintf(stderr, "Error: Compiled scene \"%s\" is truncated.\n", filename);
+      scene_fail();
+    }
+  }
+  if (!check_binary_scene(header)) {
+    fprintf(stderr, "Error: Compiled scene \"%s\" is corrupt.\n", filename);
+    scene_fail();
+  }
+
+  camera = header->camera;
+  object_count = header->object_count;
+  light_count = header->light_count;
+  Object* records = (Object*)(base + header->offset[SECTION_OBJECTS]);
+  Object* light_records = (Object*)(base + header->offset[SECTION_LIGHTS]);
+  //the renderer walks NULL-terminated pointer lists; those are the only
+  //thing built at load time
+  objects = arena_alloc(&scene_arena, sizeof(Object*) * (object_count + 1));
+  lights = arena_alloc(&scene_arena, sizeof(Object*) * (light_count + 1));
+  for (int i = 0; i < object_count; i += 1) {
+    objects[i] = &records[i];
+  }
+  for (int j = 0; j < light_count; j += 1) {
+    lights[j] = &light_records[j];
+  }
+  objects[object_count] = NULL;
+  lights[light_count] = NULL;
+
+  bvh_node_count = header->node_count;
+  bvh_nodes = (BVHNode*)(base + header->offset[SECTION_NODES]);
+  spheres.count = header->sphere_count;
+  spheres.x = (real*)(base + header->offset[SECTION_SPHERE_X]);
+  spheres.y = (real*)(base + header->offset[SECTION_SPHERE_Y]);
+  spheres.z = (real*)(base + header->offset[SECTION_SPHERE_Z]);
+  spheres.r2 = (real*)(base + header->offset[SECTION_SPHERE_R2]);
+  spheres.id = (int*)(base + header->offset[SECTION_SPHERE_ID]);
+  planes.count = header->plane_count;
+  plane_count = planes.count;
+  planes.nx = (real*)(base + header->offset[SECTION_PLANE_NX]);
+  planes.ny = (real*)(base + header->offset[SECTION_PLANE_NY]);
+  planes.nz = (real*)(base + header->offset[SECTION_PLANE_NZ]);
+  planes.d = (real*)(base + header->offset[SECTION_PLANE_D]);
+  planes.id = (int*)(base + header->offset[SECTION_PLANE_ID]);
+  materials = (Material*)(base + header->offset[SECTION_MATERIALS]);
+  return 1;
+}
+
+//loads either a compiled scene or a JSON scene and gets it ready to trace
+void load_scene(char* filename) {
+  if (!map_binary_scene(filename)) {
+    read_scene(filename);
+    build_bvh();
+    compile_scene();
+  }
+  if (use_grid) {
+    build_grid();
+  }
+  compile_lights();
+}
+
+//releases what compile_lights() built
+void free_lights(void) {
+  free(light_active);
+  free(light_table);
+}
+
+//releases everything load_scene built so another scene can be loaded
+void unload_scene(void) {
+  if (scene_map != NULL) {
+    munmap(scene_map, scene_map_size);
+    scene_map = NULL;
+  } else {
+    free(bvh_nodes);
+    free(bvh_prims);
+    free(plane_list);
+    free(spheres.x);
+    free(spheres.y);
+    free(spheres.z);
+    free(spheres.r2);
+    free(spheres.id);
+    free(planes.nx);
+    free(planes.ny);
+    free(planes.nz);
+    free(planes.d);
+    free(planes.id);
+    free(materials);
+  }
+  free_grid();
+  free_lights();
+  arena_free(&scene_arena);
+}
+
+real static clamp(real s){
+ if(s > 1){
+     return 1;
+ }else if (s < 0){
+     return s;
+ }else{
+     return s;
+ }
+}
+
+//Hit record for one primary ray, kept on the stack of whoever shades it:
+//the object hit, the distance along the ray, the material to shade with
+//(each object currently carries its own) and the color gathered so far.
+typedef struct {
+    int hit;
+    int material;
+    real t;
+    real position[3];
+    real view[3];
+    real normal[3];
+    real light_object[3];
+    real color[3];
+} ShadePoint;
+
+//Per-pixel G-buffer kept by batch mode so a scene edit can be applied to
+//the previous frame: the primary hit and which lights were shadowed there.
+//It is only kept for one sample per pixel and up to GBUFFER_LIGHTS lights.
+#define GBUFFER_LIGHTS 64
+typedef struct {
+    int hit;
+    real t;
+    uint64_t shadowed;
+} GPixel;
+
+GPixel* gbuffer;
+
+//builds the primary ray through the image point (sx, sy), in pixels
+static inline void sample_ray(real sx, real sy, real* Ro, real* Rd) {
+    Ro[0] = camera.center[0];
+    Ro[1] = camera.center[1];
+    Ro[2] = camera.center[2];
+    // Rd = normalize(P - Ro)
+    Rd[0] = Ro[0] - (camera.camera.width/2) + pixwidth * sx;
+    Rd[1] = Ro[1] - (camera.camera.height/2) + pixheight * sy;
+    Rd[2] = 1;
+    normalize(Rd);
+}
+
+//builds the primary ray through the center of pixel (x, y)
+static inline void primary_ray(int x, int y, real* Ro, real* Rd) {
+    sample_ray(x + 0.5, y + 0.5, Ro, Rd);
+}
+
+//fills in everything about a hit that does not depend on the light
+void shade_begin(ShadePoint* sp, real* Ro, real* Rd, real best_t, int hit) {
+    Object* object = objects[hit];
+    sp->hit = hit;
+    sp->material = hit;
+    sp->t = best_t;
+    sp->color[0] = 0;
+    sp->color[1] = 0;
+    sp->color[2] = 0;
+    real* object_position = sp->view;
+    real* Pixel_position = sp->position;
+    real* N = sp->normal;
+    Pixel_position[0] = Rd[0] * best_t + Ro[0];
+    object_position[0] = camera.center[0] - Pixel_position[0];
+    Pixel_position[1] = Rd[1] * best_t + Ro[1];
+    object_position[1] = camera.center[1] - Pixel_position[1];
+    Pixel_position[2] = Rd[2] * best_t + Ro[2];
+    object_position[2] = camera.center[2] - Pixel_position[2];
+    normalize(object_position);
+    if (object->kind == 1){
+        N[0] = Pixel_position[0] - object->center[0];
+        N[1] = Pixel_position[1] - object->center[1];
+        N[2] = Pixel_position[2] - object->center[2];
+    }else if (object->kind == 0){
+        N[0] = object->plane.normal[0];
+        N[1] = object->plane.normal[1];
+        N[2] = object->plane.normal[2];
+    }
+    normalize(N);
+    sp->light_object[0] = Rd[0] * best_t + Ro[0];
+    sp->light_object[1] = Rd[1] * best_t + Ro[1];
+    sp->light_object[2] = Rd[2] * best_t + Ro[2];
+    normalize(sp->light_object);
+}
+
+//shadow ray from the hit toward light j; returns the distance to the light
+static inline real light_ray(ShadePoint* sp, int j, real* object_light) {
+    real* Pixel_position = sp->position;
+    real* center = light_table[j].position;
+    object_light[0] = center[0] - Pixel_position[0];
+    object_light[1] = center[1] - Pixel_position[1];
+    object_light[2] = center[2] - Pixel_position[2];
+    normalize(object_light);
+    return sqrt(sqr(Pixel_position[0] - center[0])
+    + sqr(Pixel_position[1] - center[1]) 
+    + sqr(Pixel_position[2] - center[2]));
+}
+
+//the diffuse and specular factors light j, seen along object_light, gives
+//the hit in sp; terms[0] is the diffuse one and terms[1] the specular one
+static inline void light_terms(ShadePoint* sp, int j, real* object_light, real* terms) {
+    real* N = sp->normal;
+    real* light_object = sp->light_object;
+    real* object_position = sp->view;
+    real* L = light_table[j].direction;
+    real R[3];
+    
+    R[0] = light_object[0] - 2 * (N[0] * light_object[0] + N[1] * light_object[1] + N[2] * light_object[2]) * N[0];
+    R[1] = light_object[1] - 2 * (N[0] * light_object[0] + N[1] * light_object[1] + N[2] * light_object[2]) * N[1];
+    R[2] = light_object[2] - 2 * (N[0] * L[0] + N[1] * L[1] + N[2] * L[2]) * N[2];
+    normalize(R);
+    real difuse = (N[0] * object_light[0] + N[1] * object_light[1] + N[2] * object_light[2]);
+    real specular2 = (R[0] * object_position[0] + R[1] * object_position[1] + object_position[2] * R[2]);
+    if(difuse <= 0){
+        difuse = 0;
+    }
+    if (specular2 <= 0 && difuse <= 0){
+        specular2 = 0;
+    }
+    terms[0] = difuse;
+    terms[1] = ipow(specular2, SPECULAR_EXPONENT);
+}
+
+//Per-point light culling: a light adds nothing to a surface that faces away
+//from it unless a highlight shows, and then its shadow ray can be skipped.
+//true if terms, from light_terms(), add nothing to the hit in sp
+static inline int light_unseen(ShadePoint* sp, real* terms) {
+    real* specular = materials[sp->material].specular;
+    return terms[0] == 0 && (terms[1] == 0 || (specular[0] == 0 && specular[1] == 0 && specular[2] == 0));
+}
+
+//adds the diffuse and specular light from an unshadowed light j, at
+//distance dl, given its terms from light_terms()
+void shade_light(ShadePoint* sp, int j, real* terms, real dl) {
+    LightRecord* light = &light_table[j];
+    Material* material = &materials[sp->material];
+    real* color = sp->color;
+    real frad =(1/(light->radial[2]*sqr(dl) + light->radial[1]*dl + light->radial[0]*dl));
+    real difuse = terms[0];
+    real specular3 = terms[1];
+    color[0] += frad*light->spot*((light->color[0]*difuse*material->diffuse[0]) + (light->color[0] * specular3 * material->specular[0]));
+    color[1] += frad*light->spot*((light->color[1]*difuse*material->diffuse[1]) + (light->color[1] * specular3 * material->specular[1]));
+    color[2] += frad*light->spot*((light->color[2]*difuse*material->diffuse[2]) + (light->color[2] * specular3 * material->specular[2]));
+}
+
+//the tile a thread of a tiled render is filling, with its top left corner;
+//NULL everywhere else
+#define CHECKPOINT_TILE 256
+_Thread_local float* tile_pixels;
+_Thread_local int tile_x;
+_Thread_local int tile_y;
+
+//position of pixel (x, y) in image. image holds image_rows rows, which is
+//the whole frame unless the output is being streamed through a ring of bands.
+//In a tiled render it is the position in the thread's tile instead.
+static inline int pixel_index(int x, int y) {
+    if (tile_pixels != NULL) {
+        return (y - tile_y) * CHECKPOINT_TILE + (x - tile_x);
+    }
+    return (y % image_rows) * image_width + x;
+}
+
+//the radiance of the pixel at index, as returned by pixel_index()
+static inline float* pixel_at(int index) {
+    return (tile_pixels != NULL ? tile_pixels : framebuffer) + 3 * (long)index;
+}
+
+//writes a shaded color into framebuffer, or the white background for a miss
+static inline void put_pixel(int index, real* color) {
+    float* p = pixel_at(index);
+    if (color != NULL) {
+        p[0] = color[0];
+        p[1] = color[1];
+        p[2] = color[2];
+    }else{
+        p[0] = 1;
+        p[1] = 1;
+        p[2] = 1;
+    }
+}
+
+//adds the light from every unshadowed light to the hit in sp. Shadow rays
+//are traced toward the lights in dirty; with a G-buffer pixel g the others
+//take their shadow from g, and the traced ones are recorded in it. A light
+//the hit cannot see is recorded as shadowed without a shadow ray.
+static void shade_lights(ShadePoint* sp, GPixel* g, uint64_t dirty) {
+    for(int j = 0; lights[j] != NULL; j += 1){
+        if (!light_active[j]) {
+            continue;
+        }
+        real object_light[3];
+        real dl = light_ray(sp, j, object_light);
+        real terms[2];
+        light_terms(sp, j, object_light, terms);
+        int blocked;
+        if (light_unseen(sp, terms)) {
+            STAT_ADD(shadow_culled, 1);
+            blocked = 1;
+            if (g != NULL) {
+                g->shadowed |= 1ull << j;
+            }
+        } else if (g != NULL && !((dirty >> j) & 1)) {
+            blocked = (g->shadowed >> j) & 1;
+        } else {
+            uint64_t start = STAT_CLOCK();
+            blocked = light_blocked(sp->position, object_light, dl, sp->hit, j);
+            STAT_ADD(shadow_rays, 1);
+            STAT_ADD(shadow_early_outs, blocked);
+            STAT_ADD(shadow_cycles, STAT_CLOCK() - start);
+            if (g != NULL) {
+                g->shadowed = (g->shadowed & ~(1ull << j)) | ((uint64_t)blocked << j);
+            }
+        }
+        if (!blocked) {
+            uint64_t start = STAT_CLOCK();
+            shade_light(sp, j, terms, dl);
+            STAT_ADD(shade_cycles, STAT_CLOCK() - start);
+        }
+    }
+}
+
+//Reflections (--reflect N). A hit reflects what its specular color lets
+//through, up to N bounces deep. Rather than recursing per pixel, each
+//thread queues the reflection rays of the pixels it shades and traces them
+//when it finishes a tile (or a chunk of progressive samples), one depth at a
+//time: the whole wavefront of first bounces, then the second, and so on.
+//Every ray carries its weight, the product of the specular colors along
+//its path and the share of the pixel its primary sample makes up, and adds
+//weight times what it sees to its pixel; a miss sees the white background.
+//A bounce whose weight falls below reflect_energy in every channel is not
+//traced. --ray-budget caps the reflection rays of a frame: every thread
+//draws the rays of each wavefront from one pool that holds the budget when
+//the frame starts, and when the pool cannot cover a wavefront its weakest
+//rays are dropped. A frame under budget drops nothing and one over budget
+//traces exactly the budget; which tiles lose their rays then depends on the
+//order threads finish them in, so only a single-thread render is the same
+//on every run once the budget runs out.
+typedef struct {
+    int pixel;
+    real origin[3];
+    real direction[3];
+    real weight[3];
+} ReflectionRay;
+
+int reflect_depth;
+real reflect_energy = 1.0 / MAXCOLOR;
+long ray_budget;
+
+static _Thread_local ReflectionRay* reflect_queue[2];
+static _Thread_local int reflect_count[2];
+static _Thread_local int reflect_capacity[2];
+//reflection rays the current frame may still trace
+atomic_long reflect_rays_left;
+
+//refills the pool for a new frame
+static void reset_ray_budget(void) {
+    atomic_store(&reflect_rays_left, ray_budget > 0 ? ray_budget : LONG_MAX);
+}
+
+//takes up to wanted rays from the pool and returns how many it got
+static long claim_rays(long wanted) {
+    long left = atomic_load(&reflect_rays_left);
+    long taken = left < wanted ? left : wanted;
+    while (taken > 0 && !atomic_compare_exchange_weak(&reflect_rays_left, &left, left - taken)) {
+        taken = left < wanted ? left : wanted;
+    }
+    return taken;
+}
+
+//queues the mirror ray leaving the hit in sp for pixel, seen along Rd,
+//unless weight is too faint to matter
+static void queue_reflection(int queue, int pixel, ShadePoint* sp, real* Rd, real* weight) {
+    if (weight[0] < reflect_energy && weight[1] < reflect_energy && weight[2] < reflect_energy) {
+        return;
+    }
+    if (reflect_count[queue] == reflect_capacity[queue]) {
+        reflect_capacity[queue] = reflect_capacity[queue] > 0 ? 2 * reflect_capacity[queue] : 1024;
+        reflect_queue[queue] = realloc(reflect_queue[queue], sizeof(ReflectionRay) * reflect_capacity[queue]);
+    }
+    ReflectionRay* r = &reflect_queue[queue][reflect_count[queue]++];
+    real* N = sp->normal;
+    real d = Rd[0] * N[0] + Rd[1] * N[1] + Rd[2] * N[2];
+    r->pixel = pixel;
+    for (int a = 0; a < 3; a += 1) {
+        r->direction[a] = Rd[a] - 2 * d * N[a];
+        //start just off the surface so the ray cannot meet it again
+        r->origin[a] = sp->position[a] + N[a] * (d < 0 ? shadow_epsilon : -shadow_epsilon);
+        r->weight[a] = weight[a];
+    }
+}
+
+//queues the first bounce of a primary hit that makes up share of its pixel
+static inline void queue_primary_reflection(int pixel, ShadePoint* sp, real* Rd, real share) {
+    if (reflect_depth > 0 && pixel >= 0) {
+        real* specular = materials[sp->material].specular;
+        real weight[3] = {specular[0] * share, specular[1] * share, specular[2] * share};
+        queue_reflection(0, pixel, sp, Rd, weight);
+    }
+}
+
+//scales the first-bounce rays queued since from by scale, dropping any
+//that become too faint to matter
+static void rescale_reflections(int from, real scale) {
+    int kept = from;
+    for (int i = from; i < reflect_count[0]; i += 1) {
+        ReflectionRay* r = &reflect_queue[0][i];
+        for (int c = 0; c < 3; c += 1) {
+            r->weight[c] *= scale;
+        }
+        if (r->weight[0] >= reflect_energy || r->weight[1] >= reflect_energy || r->weight[2] >= reflect_energy) {
+            reflect_queue[0][kept++] = *r;
+        }
+    }
+    reflect_count[0] = kept;
+}
+
+//strongest first, then by pixel so the order does not depend on the queue's
+static int reflection_order(const void* a, const void* b) {
+    const ReflectionRay* ra = a;
+    const ReflectionRay* rb = b;
+    real ea = fmax(ra->weight[0], fmax(ra->weight[1], ra->weight[2]));
+    real eb = fmax(rb->weight[0], fmax(rb->weight[1], rb->weight[2]));
+    if (ea != eb) {
+        return ea > eb ? -1 : 1;
+    }
+    return ra->pixel - rb->pixel;
+}
+
+//traces the queued reflections wavefront by wavefront and adds what they
+//see to their pixels
+static void trace_reflections(void) {
+    int current = 0;
+    for (int depth = 1; depth <= reflect_depth && reflect_count[current] > 0; depth += 1) {
+        int next = 1 - current;
+        int count = reflect_count[current];
+        long allowed = claim_rays(count);
+        if (count > allowed) {
+            if (allowed > 0) {
+                qsort(reflect_queue[current], count, sizeof(ReflectionRay), reflection_order);
+            }
+            STAT_ADD(reflections_dropped, count - allowed);
+            count = (int)allowed;
+        }
+        reflect_count[next] = 0;
+        for (int i = 0; i < count; i += 1) {
+            ReflectionRay r = reflect_queue[current][i];
+            real best_t;
+            uint64_t start = STAT_CLOCK();
+            int hit = closest_hit(r.origin, r.direction, &best_t);
+            STAT_ADD(reflection_rays, 1);
+            STAT_ADD(primary_cycles, STAT_CLOCK() - start);
+            float* p = pixel_at(r.pixel);
+            if (hit < 0) {
+                p[0] += r.weight[0];
+                p[1] += r.weight[1];
+                p[2] += r.weight[2];
+                continue;
+            }
+            ShadePoint sp;
+            shade_begin(&sp, r.origin, r.direction, best_t, hit);
+            //shade_begin() looks from the camera; this hit is seen along the
+            //reflected ray
+            for (int a = 0; a < 3; a += 1) {
+                sp.view[a] = -r.direction[a];
+                sp.light_object[a] = r.direction[a];
+            }
+            normalize(sp.view);
+            normalize(sp.light_object);
+            shade_lights(&sp, NULL, ~(uint64_t)0);
+            p[0] += r.weight[0] * sp.color[0];
+            p[1] += r.weight[1] * sp.color[1];
+            p[2] += r.weight[2] * sp.color[2];
+            if (depth < reflect_depth) {
+                real* specular = materials[sp.material].specular;
+                real weight[3] = {r.weight[0] * specular[0], r.weight[1] * specular[1], r.weight[2] * specular[2]};
+                queue_reflection(next, r.pixel, &sp, r.direction, weight);
+            }
+        }
+        reflect_count[current] = 0;
+        current = next;
+    }
+    reflect_count[0] = 0;
+    reflect_count[1] = 0;
+}
+
+//gives back a finished thread's queues
+static void free_reflections(void) {
+    for (int q = 0; q < 2; q += 1) {
+        free(reflect_queue[q]);
+        reflect_queue[q] = NULL;
+        reflect_count[q] = 0;
+        reflect_capacity[q] = 0;
+    }
+}
+
+//traces the ray from Ro along Rd and shades it into color, or returns 0 if
+//it misses everything. The hit is recorded in g unless it is NULL, and its
+//reflection is queued for pixel unless that is negative, weighted by the
+//share of the pixel this ray makes up. All hit state is local so any number
+//of threads can call this at once.
+static int trace_primary(real* Ro, real* Rd, real* color, GPixel* g, int pixel, real share) {
+    real best_t;
+    uint64_t start = STAT_CLOCK();
+    int hit = closest_hit(Ro, Rd, &best_t);
+    STAT_ADD(primary_rays, 1);
+    STAT_ADD(primary_cycles, STAT_CLOCK() - start);
+    if (g != NULL) {
+        g->hit = hit;
+        g->t = best_t;
+        g->shadowed = 0;
+    }
+    if (hit < 0) {
+        return 0;
+    }
+    ShadePoint sp;
+    shade_begin(&sp, Ro, Rd, best_t, hit);
+    shade_lights(&sp, g, ~(uint64_t)0);
+    queue_primary_reflection(pixel, &sp, Rd, share);
+    color[0] = sp.color[0];
+    color[1] = sp.color[1];
+    color[2] = sp.color[2];
+    return 1;
+}
+
+//Supersampling. A pixel's samples are jittered inside strata that tile
+//it: floor(sqrt(n)) rows of equal height, each split evenly into its share
+//of the n samples, so every part of the pixel is covered whatever n is.
+//spp_x/spp_y hold each stratum's corner and spp_width its width, in the
+//order they are traced; the order spreads every prefix over the pixel: the
+//first SPP_FIRST samples are traced, and only if their colors differ by
+//more than refine_threshold (in 8-bit steps) in some channel are the rest
+//traced too.
+#define MAX_SPP 64
+#define SPP_FIRST 4
+real spp_x[MAX_SPP];
+real spp_y[MAX_SPP];
+real spp_width[MAX_SPP];
+real spp_height;
+
+//lays out the strata for samples_per_pixel samples, ordered by repeatedly
+//taking the stratum farthest from every one taken so far
+void build_sample_pattern(void) {
+    int n = samples_per_pixel;
+    int rows = 1;
+    while ((rows + 1) * (rows + 1) <= n) {
+        rows += 1;
+    }
+    real cx[MAX_SPP], cy[MAX_SPP], width[MAX_SPP];
+    int taken[MAX_SPP] = {0};
+    int strata = 0;
+    for (int r = 0; r < rows; r += 1) {
+        int columns = n / rows + (r < n % rows);
+        for (int c = 0; c < columns; c += 1) {
+            width[strata] = 1.0 / columns;
+            cx[strata] = (c + 0.5) / columns;
+            cy[strata] = (r + 0.5) / rows;
+            strata += 1;
+        }
+    }
+    spp_height = 1.0 / rows;
+    int pick = 0;
+    real picked_x[MAX_SPP], picked_y[MAX_SPP];
+    for (int k = 0; k < n; k += 1) {
+        taken[pick] = 1;
+        picked_x[k] = cx[pick];
+        picked_y[k] = cy[pick];
+        spp_width[k] = width[pick];
+        spp_x[k] = cx[pick] - width[pick] / 2;
+        spp_y[k] = cy[pick] - spp_height / 2;
+        real farthest = -1;
+        for (int i = 0; i < n; i += 1) {
+            if (taken[i]) {
+                continue;
+            }
+            real nearest = INFINITY;
+            for (int m = 0; m <= k; m += 1) {
+                real d = sqr(cx[i] - picked_x[m]) + sqr(cy[i] - picked_y[m]);
+                nearest = d < nearest ? d : nearest;
+            }
+            if (nearest > farthest) {
+                farthest = nearest;
+                pick = i;
+            }
+        }
+    }
+}
+
+//integer hash used as a per-sample random number in [0, 1). It only
+//depends on the pixel and sample, so images do not change with threads.
+//The input is 64-bit so every sample of a frame of any size has its own.
+static inline real sample_random(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return (h >> 40) * (1.0 / 16777216);
+}
+
+//renders pixel (x, y) with up to samples_per_pixel jittered samples
+static void render_pixel_spp(int x, int y) {
+    real sx[MAX_SPP], sy[MAX_SPP];
+    uint64_t seed = ((uint64_t)y * image_width + x) * (2 * MAX_SPP);
+    int n = samples_per_pixel;
+    //branch-free, so the compiler can vectorize it
+    for (int i = 0; i < n; i += 1) {
+        sx[i] = x + spp_x[i] + spp_width[i] * sample_random(seed + 2 * i);
+        sy[i] = y + spp_y[i] + spp_height * sample_random(seed + 2 * i + 1);
+    }
+    real sum[3] = {0, 0, 0};
+    real lo[3] = {INFINITY, INFINITY, INFINITY};
+    real hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    int first = n < SPP_FIRST ? n : SPP_FIRST;
+    int count = first;
+    int index = pixel_index(x, y);
+    int queued = reflect_count[0];
+    for (int i = 0; i < count; i += 1) {
+        real Ro[3], Rd[3], color[3] = {1, 1, 1};
+        sample_ray(sx[i], sy[i], Ro, Rd);
+        trace_primary(Ro, Rd, color, NULL, index, (real)1 / count);
+        for (int c = 0; c < 3; c += 1) {
+            sum[c] += color[c];
+            //the spread is judged on what the display can show
+            color[c] = clamp(color[c]);
+            lo[c] = color[c] < lo[c] ? color[c] : lo[c];
+            hi[c] = color[c] > hi[c] ? color[c] : hi[c];
+        }
+        if (i == first - 1) {
+            real spread = fmax(hi[0] - lo[0], fmax(hi[1] - lo[1], hi[2] - lo[2]));
+            if (spread * MAXCOLOR > refine_threshold) {
+                count = n;
+                //the first samples' reflections now count for 1 / n each
+                rescale_reflections(queued, (real)first / n);
+            }
+        }
+    }
+    sum[0] /= count;
+    sum[1] /= count;
+    sum[2] /= count;
+    put_pixel(index, sum);
+}
+
+//renders the pixel at column x, row y straight into image
+void render_pixel(int x, int y) {
+    if (samples_per_pixel > 1) {
+        render_pixel_spp(x, y);
+        return;
+    }
+    real Ro[3];
+    real Rd[3];
+    real color[3];
+    GPixel* g = gbuffer != NULL ? &gbuffer[y * image_width + x] : NULL;
+    int index = pixel_index(x, y);
+    primary_ray(x, y, Ro, Rd);
+        //set the color for the pixel
+    put_pixel(index, trace_primary(Ro, Rd, color, g, index, 1) ? color : NULL);
+}
+
+//renders the PACKET_DIM x PACKET_DIM block at (x0, y0) with ray packets
+void render_block(int x0, int y0) {
+    RayPacket p;
+    ShadePoint sp[PACKET_SIZE];
+    int index[PACKET_SIZE];
+    p.count = 0;
+    for (int y = y0; y < y0 + PACKET_DIM; y += 1) {
+        for (int x = x0; x < x0 + PACKET_DIM; x += 1) {
+            int l = p.count++;
+            real Ro[3], Rd[3];
+            if (x < image_width && y < image_height) {
+                primary_ray(x, y, Ro, Rd);
+                index[l] = pixel_index(x, y);
+                p.t[l] = INFINITY;
+            } else {
+                //lanes past the edge of the image ride along but never hit
+                primary_ray(x0, y0, Ro, Rd);
+                index[l] = -1;
+                p.t[l] = -INFINITY;
+            }
+            packet_set_ray(&p, l, Ro, Rd);
+            p.skip[l] = -1;
+        }
+    }
+    uint64_t start = STAT_CLOCK();
+    packet_closest_hit(&p);
+    STAT_ADD(primary_cycles, STAT_CLOCK() - start);
+
+    int lit = 0;
+    for (int l = 0; l < PACKET_SIZE; l += 1) {
+        if (index[l] < 0) {
+            continue;
+        }
+        STAT_ADD(primary_rays, 1);
+        if (p.hit[l] < 0) {
+            put_pixel(index[l], NULL);
+            continue;
+        }
+        real Ro[3] = {p.ox[l], p.oy[l], p.oz[l]};
+        real Rd[3] = {p.dx[l], p.dy[l], p.dz[l]};
+        shade_begin(&sp[l], Ro, Rd, p.t[l], p.hit[l]);
+        lit += 1;
+    }
+    if (lit == 0) {
+        return;
+    }
+
+    //one bundle of shadow rays per light, from every hit point toward it
+    for (int j = 0; lights[j] != NULL; j += 1) {
+        if (!light_active[j]) {
+            continue;
+        }
+        RayPacket shadow;
+        real object_light[PACKET_SIZE][3];
+        real dl[PACKET_SIZE];
+        real terms[PACKET_SIZE][2];
+        int traced = 0;
+        shadow.count = PACKET_SIZE;
+        for (int l = 0; l < PACKET_SIZE; l += 1) {
+            int seen = 0;
+            if (index[l] >= 0 && p.hit[l] >= 0) {
+                dl[l] = light_ray(&sp[l], j, object_light[l]);
+                light_terms(&sp[l], j, object_light[l], terms[l]);
+                seen = !light_unseen(&sp[l], terms[l]);
+                STAT_ADD(shadow_culled, !seen);
+            }
+            if (seen) {
+                traced += 1;
+                packet_set_ray(&shadow, l, sp[l].position, object_light[l]);
+                shadow.t[l] = dl[l];
+                shadow.skip[l] = p.hit[l];
+            } else {
+                real idle[3] = {0, 0, 1};
+                packet_set_ray(&shadow, l, idle, idle);
+                shadow.t[l] = -INFINITY;
+                shadow.skip[l] = -1;
+            }
+            shadow.hit[l] = -1;
+        }
+        start = STAT_CLOCK();
+        packet_try_cached(&shadow, j);
+        packet_occluded(&shadow);
+        for (int l = 0; l < PACKET_SIZE; l += 1) {
+            if (shadow.t[l] >= 0 && shadow.hit[l] >= 0 && j < OCCLUDER_CACHE_LIGHTS) {
+                last_occluder[j] = shadow.hit[l] + 1;
+                break;
+            }
+        }
+        STAT_ADD(shadow_cycles, STAT_CLOCK() - start);
+        STAT_ADD(shadow_rays, traced);
+        start = STAT_CLOCK();
+        for (int l = 0; l < PACKET_SIZE; l += 1) {
+            if (shadow.t[l] >= 0 && shadow.hit[l] < 0) {
+                shade_light(&sp[l], j, terms[l], dl[l]);
+            } else if (shadow.t[l] >= 0) {
+                STAT_ADD(shadow_early_outs, 1);
+            }
+        }
+        STAT_ADD(shade_cycles, STAT_CLOCK() - start);
+    }
+    for (int l = 0; l < PACKET_SIZE; l += 1) {
+        if (index[l] >= 0 && p.hit[l] >= 0) {
+            put_pixel(index[l], sp[l].color);
+            real Rd[3] = {p.dx[l], p.dy[l], p.dz[l]};
+            queue_primary_reflection(index[l], &sp[l], Rd, 1);
+        }
+    }
+}
+
+//Streaming output. Tiles are claimed in scanline order, so the frame is
+//produced one band of TILE_SIZE rows at a time. While streaming, image is a
+//ring of ring_bands bands: a worker waits before starting a band whose slot
+//still holds one the writer has not flushed, and the writer emits bands in
+//order as soon as all of their tiles are done. framebuffer is a ring of the
+//same shape.
+FILE* stream_out;
+int stream_format;
+long stream_header;
+int ring_bands;
+int bands_written;
+int* band_done;
+pthread_mutex_t band_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t band_cond = PTHREAD_COND_INITIALIZER;
+
+//Output encoders, chosen by the file's extension: .pfm keeps the radiance
+//as 32-bit floats, anything else is an 8-bit PPM through the post pass.
+enum { FORMAT_PPM, FORMAT_PFM };
+
+static int output_format(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    return dot != NULL && strcasecmp(dot, ".pfm") == 0 ? FORMAT_PFM : FORMAT_PPM;
+}
+
+//writes the header and returns its length, where the pixel data starts
+static long write_header(FILE* out, int format) {
+    if (format == FORMAT_PFM) {
+        //the negative scale marks little-endian floats
+        return fprintf(out, "PF\n%d %d\n-1.0\n", image_width, image_height);
+    }
+    return fprintf(out, "P6\n%d %d\n%d\n", image_width, image_height, MAXCOLOR);
+}
+
+//writes rows y to y + rows - 1, which start at radiance, quantizing a PPM
+//through pixels. PFM stores the bottom row first, so those rows are placed
+//by offset from header, the length write_header() returned; PPM rows just
+//follow each other.
+static void write_rows(FILE* out, int format, long header, float* radiance, Pixel* pixels, int y, int rows) {
+    long count = (long)rows * image_width;
+    if (format == FORMAT_PPM) {
+        tone_map(radiance, (unsigned char*)pixels, 3 * count);
+        fwrite(pixels, sizeof(Pixel), count, out);
+        return;
+    }
+    long row_bytes = 3 * sizeof(float) * (long)image_width;
+    if (fseek(out, header + (image_height - y - rows) * row_bytes, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: PFM output needs a seekable file.\n");
+        exit(1);
+    }
+    for (int r = rows - 1; r >= 0; r -= 1) {
+        fwrite(radiance + 3 * (long)r * image_width, sizeof(float), 3 * image_width, out);
+    }
+}
+
+//renders one tile, either pixel by pixel or in packets
+static void render_tile(int x0, int y0) {
+    if (use_packets && !use_grid && samples_per_pixel == 1 && gbuffer == NULL) {
+        for (int y = y0; y < y0 + TILE_SIZE && y < image_height; y += PACKET_DIM) {
+            for (int x = x0; x < x0 + TILE_SIZE && x < image_width; x += PACKET_DIM) {
+                render_block(x, y);
+            }
+        }
+    } else {
+        for (int y = y0; y < y0 + TILE_SIZE && y < image_height; y += 1) {
+            for (int x = x0; x < x0 + TILE_SIZE && x < image_width; x += 1) {
+                render_pixel(x, y);
+            }
+        }
+    }
+    if (reflect_depth > 0) {
+        trace_reflections();
+    }
+}
+
+//worker loop: keeps grabbing the next unclaimed tile until none are left
+void* render_worker(void* arg) {
+    int tiles_x = (image_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (image_height + TILE_SIZE - 1) / TILE_SIZE;
+    int tile;
+    while ((tile = atomic_fetch_add(&next_tile, 1)) < tiles_x * tiles_y) {
+        int x0 = (tile % tiles_x) * TILE_SIZE;
+        int band = tile / tiles_x;
+        if (stream_out != NULL) {
+            pthread_mutex_lock(&band_lock);
+            while (band >= bands_written + ring_bands) {
+                pthread_cond_wait(&band_cond, &band_lock);
+            }
+            pthread_mutex_unlock(&band_lock);
+        }
+        render_tile(x0, band * TILE_SIZE);
+        if (stream_out != NULL) {
+            pthread_mutex_lock(&band_lock);
+            band_done[band % ring_bands] += 1;
+            if (band_done[band % ring_bands] == tiles_x) {
+                pthread_cond_broadcast(&band_cond);
+            }
+            pthread_mutex_unlock(&band_lock);
+        }
+    }
+    free_reflections();
+    STAT_FLUSH();
+    return NULL;
+}
+
+//writer side of the stream: flushes bands in order as they complete
+static void write_bands(void) {
+    int tiles_x = (image_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (image_height + TILE_SIZE - 1) / TILE_SIZE;
+    for (int band = 0; band < tiles_y; band += 1) {
+        int slot = band % ring_bands;
+        pthread_mutex_lock(&band_lock);
+        while (band_done[slot] < tiles_x) {
+            pthread_cond_wait(&band_cond, &band_lock);
+        }
+        pthread_mutex_unlock(&band_lock);
+        int rows = image_height - band * TILE_SIZE;
+        if (rows > TILE_SIZE) {
+            rows = TILE_SIZE;
+        }
+        uint64_t start = STAT_CLOCK();
+        int first = pixel_index(0, band * TILE_SIZE);
+        write_rows(stream_out, stream_format, stream_header, framebuffer + 3 * (long)first,
+                   image + first, band * TILE_SIZE, rows);
+        fflush(stream_out);
+        STAT_ADD(output_cycles, STAT_CLOCK() - start);
+        pthread_mutex_lock(&band_lock);
+        band_done[slot] = 0;
+        bands_written += 1;
+        pthread_cond_broadcast(&band_cond);
+        pthread_mutex_unlock(&band_lock);
+    }
+    STAT_FLUSH();
+}
+
+//splits the image into tiles and renders them on num_threads threads. With
+//out set the pixels are streamed to it through a ring of bands, encoded as
+//format after a header of header bytes; otherwise framebuffer must hold the
+//whole frame.
+void render_image(FILE* out, int format, long header) {
+    pthread_t workers[MAX_THREADS];
+    atomic_store(&next_tile, 0);
+    reset_ray_budget();
+    stream_out = out;
+    stream_format = format;
+    stream_header = header;
+    //when streaming the main thread is the writer, so every worker is extra
+    int first = out != NULL ? 0 : 1;
+    if (out != NULL) {
+        bands_written = 0;
+        band_done = calloc(ring_bands, sizeof(int));
+    }
+    for (int t = first; t < num_threads; t += 1) {
+        if (pthread_create(&workers[t], NULL, render_worker, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start render thread.\n");
+            exit(1);
+        }
+    }
+    if (out != NULL) {
+        write_bands();
+    } else {
+        //the main thread works too
+        render_worker(NULL);
+    }
+    for (int t = first; t < num_threads; t += 1) {
+        pthread_join(workers[t], NULL);
+    }
+    if (out != NULL) {
+        free(band_done);
+        stream_out = NULL;
+    }
+}
+
+//Tiled mode, for frames too big to hold. The output file is sized up front
+//and the frame is rendered in CHECKPOINT_TILE square tiles, each into a
+//buffer of its thread's own and written straight to its place in the file
+//with pwrite, so memory does not grow with the resolution. A sidecar file
+//beside the output, "<output>.checkpoint", holds one byte per tile that is
+//set once the tile is in the output. Its first line records the frame, the
+//settings and the scene file's size and time; if they still match, a
+//restarted job skips the tiles already done. The checkpoint is removed when
+//the frame is complete. Nothing is synced, so the checkpoint survives the
+//process being killed but not the machine losing power.
+typedef struct {
+    int out;
+    int checkpoint;
+    int format;
+    long header;
+    long checkpoint_header;
+    int tiles_x;
+    int tiles;
+    unsigned char* done;
+} TiledRender;
+
+TiledRender tiled;
+
+//renders tile number tile into pixels and writes it to the output
+static void render_checkpoint_tile(int tile, float* pixels, Pixel* quantized) {
+    tile_x = (tile % tiled.tiles_x) * CHECKPOINT_TILE;
+    tile_y = (tile / tiled.tiles_x) * CHECKPOINT_TILE;
+    int width = image_width - tile_x < CHECKPOINT_TILE ? image_width - tile_x : CHECKPOINT_TILE;
+    int height = image_height - tile_y < CHECKPOINT_TILE ? image_height - tile_y : CHECKPOINT_TILE;
+    tile_pixels = pixels;
+    for (int y = tile_y; y < tile_y + height; y += TILE_SIZE) {
+        for (int x = tile_x; x < tile_x + width; x += TILE_SIZE) {
+            render_tile(x, y);
+        }
+    }
+    tile_pixels = NULL;
+    uint64_t start = STAT_CLOCK();
+    for (int r = 0; r < height; r += 1) {
+        float* row = pixels + 3 * (long)r * CHECKPOINT_TILE;
+        const void* data = row;
+        size_t size = 3 * sizeof(float) * width;
+        off_t offset;
+        if (tiled.format == FORMAT_PPM) {
+            tone_map(row, (unsigned char*)quantized, 3 * width);
+            data = quantized;
+            size = sizeof(Pixel) * width;
+            offset = tiled.header + ((off_t)(tile_y + r) * image_width + tile_x) * sizeof(Pixel);
+        } else {
+            //PFM rows run bottom to top
+            offset = tiled.header + ((off_t)(image_height - 1 - tile_y - r) * image_width + tile_x) * 3 * sizeof(float);
+        }
+        if (pwrite(tiled.out, data, size, offset) != (ssize_t)size) {
+            fprintf(stderr, "Error: Could not write the output: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    unsigned char mark = 1;
+    if (pwrite(tiled.checkpoint, &mark, 1, tiled.checkpoint_header + tile) != 1) {
+        fprintf(stderr, "Error: Could not write the checkpoint: %s\n", strerror(errno));
+        exit(1);
+    }
+    STAT_ADD(output_cycles, STAT_CLOCK() - start);
+}
+
+//worker loop: claims tiles that are not done yet until none are left
+void* checkpoint_worker(void* arg) {
+    float* pixels = malloc(3 * sizeof(float) * CHECKPOINT_TILE * CHECKPOINT_TILE);
+    Pixel* quantized = malloc(sizeof(Pixel) * CHECKPOINT_TILE);
+    int tile;
+    while ((tile = atomic_fetch_add(&next_tile, 1)) < tiled.tiles) {
+        if (!tiled.done[tile]) {
+            render_checkpoint_tile(tile, pixels, quantized);
+        }
+    }
+    free(pixels);
+    free(quantized);
+    free_reflections();
+    STAT_FLUSH();
+    return NULL;
+}
+
+//renders the frame tile by tile into filename, resuming from its
+//checkpoint when there is a matching one
+void render_tiled(char* filename, char* scene_file) {
+    struct stat scene;
+    if (stat(scene_file, &scene) != 0) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", scene_file);
+        exit(1);
+    }
+    tiled.format = output_format(filename);
+    tiled.tiles_x = (image_width + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE;
+    tiled.tiles = tiled.tiles_x * ((image_height + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE);
+    char header[64];
+    if (tiled.format == FORMAT_PFM) {
+        tiled.header = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", image_width, image_height);
+    } else {
+        tiled.header = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", image_width, image_height, MAXCOLOR);
+    }
+    off_t size = tiled.header + (off_t)image_width * image_height *
+        (tiled.format == FORMAT_PFM ? 3 * sizeof(float) : sizeof(Pixel));
+    //everything the pixels depend on, so a stale checkpoint is not trusted
+    //the key holds the size of real too, since the float and double builds
+    //render slightly different pixels
+    char settings[512];
+    tiled.checkpoint_header = snprintf(settings, sizeof(settings),
+        "raycast tiles %d %d %d %d %d %d %d %a %d %d %a %ld %lld %lld\n",
+        (int)sizeof(real), image_width, image_height, CHECKPOINT_TILE, tiled.format, samples_per_pixel,
+        refine_threshold, (double)exposure, tone_curve, reflect_depth, (double)reflect_energy, ray_budget,
+        (long long)scene.st_size, (long long)scene.st_mtime);
+    if (tiled.checkpoint_header >= (long)sizeof(settings)) {
+        fprintf(stderr, "Error: The checkpoint settings do not fit in %d bytes.\n", (int)sizeof(settings));
+        exit(1);
+    }
+
+    char checkpoint_path[strlen(filename) + 16];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.checkpoint", filename);
+    tiled.done = calloc(tiled.tiles, 1);
+    tiled.out = open(filename, O_RDWR | O_CREAT, 0644);
+    tiled.checkpoint = open(checkpoint_path, O_RDWR | O_CREAT, 0644);
+    if (tiled.out < 0 || tiled.checkpoint < 0) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", tiled.out < 0 ? filename : checkpoint_path);
+        exit(1);
+    }
+    struct stat out_stat;
+    char found[sizeof(settings)];
+    int resume = fstat(tiled.out, &out_stat) == 0 && out_stat.st_size == size &&
+        pread(tiled.checkpoint, found, tiled.checkpoint_header, 0) == tiled.checkpoint_header &&
+        memcmp(found, settings, tiled.checkpoint_header) == 0 &&
+        pread(tiled.checkpoint, tiled.done, tiled.tiles, tiled.checkpoint_header) == tiled.tiles;
+    if (resume) {
+        int finished = 0;
+        for (int i = 0; i < tiled.tiles; i += 1) {
+            finished += tiled.done[i] != 0;
+        }
+        fprintf(stderr, "Resuming: %d of %d tiles already done.\n", finished, tiled.tiles);
+    } else {
+        memset(tiled.done, 0, tiled.tiles);
+        if (ftruncate(tiled.out, 0) != 0 || ftruncate(tiled.out, size) != 0 ||
+            ftruncate(tiled.checkpoint, 0) != 0 ||
+            ftruncate(tiled.checkpoint, tiled.checkpoint_header + tiled.tiles) != 0) {
+            fprintf(stderr, "Error: Could not size the output: %s\n", strerror(errno));
+            exit(1);
+        }
+        //claim the disk now rather than run out hours in
+        int error = posix_fallocate(tiled.out, 0, size);
+        if (error == ENOSPC) {
+            fprintf(stderr, "Error: Not enough space for \"%s\".\n", filename);
+            exit(1);
+        }
+        if (error != 0) {
+            fprintf(stderr, "Error: Could not size the output: %s\n", strerror(error));
+            exit(1);
+        }
+        if (pwrite(tiled.out, header, tiled.header, 0) != tiled.header ||
+            pwrite(tiled.checkpoint, settings, tiled.checkpoint_header, 0) != tiled.checkpoint_header) {
+            fprintf(stderr, "Error: Could not write file \"%s\"\n", filename);
+            exit(1);
+        }
+    }
+
+    pthread_t workers[MAX_THREADS];
+    atomic_store(&next_tile, 0);
+    reset_ray_budget();
+    for (int t = 1; t < num_threads; t += 1) {
+        if (pthread_create(&workers[t], NULL, checkpoint_worker, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start render thread.\n");
+            exit(1);
+        }
+    }
+    checkpoint_worker(NULL);
+    for (int t = 1; t < num_threads; t += 1) {
+        pthread_join(workers[t], NULL);
+    }
+    if (close(tiled.out) != 0) {
+        fprintf(stderr, "Error: Could not write file \"%s\"\n", filename);
+        exit(1);
+    }
+    close(tiled.checkpoint);
+    unlink(checkpoint_path);
+    free(tiled.done);
+}
+
+//Progressive mode. The first stage traces every PROGRESSIVE_STEP-th pixel
+//in both directions (1/16 of the frame) and fills the blocks between them by
+//bilinear interpolation. Each later stage halves the step, but only inside
+//blocks whose corner samples differ by more than refine_threshold in
+//some channel, so smooth areas keep their interpolated fill. A preview of
+//the whole frame is written after every stage. Detail smaller than a block
+//that no corner happens to hit is missed.
+#define PROGRESSIVE_STEP 4
+#define SAMPLE_CHUNK 64
+unsigned char* sampled;
+int* sample_list;
+int sample_count;
+
+//worker loop for one stage: claims chunks of sample_list until it runs out
+void* sample_worker(void* arg) {
+    int first;
+    while ((first = atomic_fetch_add(&next_tile, SAMPLE_CHUNK)) < sample_count) {
+        for (int i = first; i < first + SAMPLE_CHUNK && i < sample_count; i += 1) {
+            render_pixel(sample_list[i] % image_width, sample_list[i] / image_width);
+        }
+        if (reflect_depth > 0) {
+            trace_reflections();
+        }
+    }
+    free_reflections();
+    STAT_FLUSH();
+    return NULL;
+}
+
+//traces the pixels queued in sample_list on num_threads threads
+static void render_samples(void) {
+    pthread_t workers[MAX_THREADS];
+    atomic_store(&next_tile, 0);
+    for (int t = 1; t < num_threads; t += 1) {
+        if (pthread_create(&workers[t], NULL, sample_worker, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start render thread.\n");
+            exit(1);
+        }
+    }
+    sample_worker(NULL);
+    for (int t = 1; t < num_threads; t += 1) {
+        pthread_join(workers[t], NULL);
+    }
+}
+
+//queues pixel (x, y) for this stage unless it has been traced already
+static inline void queue_sample(int x, int y) {
+    int index = y * image_width + x;
+    if (!sampled[index]) {
+        sampled[index] = 1;
+        sample_list[sample_count++] = index;
+    }
+}
+
+//fills the untraced pixels of the block between (x0, y0) and (x1, y1) from
+//its corners and returns whether the corners agree within the threshold
+static int fill_block(int x0, int y0, int x1, int y1) {
+    float* c[4] = {
+        framebuffer + 3 * (y0 * image_width + x0),
+        framebuffer + 3 * (y0 * image_width + x1),
+        framebuffer + 3 * (y1 * image_width + x0),
+        framebuffer + 3 * (y1 * image_width + x1),
+    };
+    int smooth = 1;
+    for (int k = 0; k < 3; k += 1) {
+        //the corners are compared as the display would show them
+        real lo = INFINITY;
+        real hi = -INFINITY;
+        for (int i = 0; i < 4; i += 1) {
+            real v = clamp(c[i][k] * exposure) * MAXCOLOR;
+            lo = v < lo ? v : lo;
+            hi = v > hi ? v : hi;
+        }
+        if (hi - lo > refine_threshold) {
+            smooth = 0;
+        }
+    }
+    for (int y = y0; y <= y1; y += 1) {
+        real fy = y1 > y0 ? (real)(y - y0) / (y1 - y0) : 0;
+        for (int x = x0; x <= x1; x += 1) {
+            int index = y * image_width + x;
+            if (sampled[index]) {
+                continue;
+            }
+            real fx = x1 > x0 ? (real)(x - x0) / (x1 - x0) : 0;
+            float* p = framebuffer + 3 * index;
+            for (int k = 0; k < 3; k += 1) {
+                real top = c[0][k] + (c[1][k] - c[0][k]) * fx;
+                real bottom = c[2][k] + (c[3][k] - c[2][k]) * fx;
+                p[k] = top + (bottom - top) * fy;
+            }
+        }
+    }
+    return smooth;
+}
+
+//writes the frame in framebuffer in the output's format. A file is written
+//beside the output and renamed over it so a viewer never sees half a
+//preview; on stdout the previews simply follow each other.
+static void write_preview(char* filename) {
+    int to_stdout = strcmp(filename, "-") == 0;
+    char temp[strlen(filename) + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    FILE* out = to_stdout ? stdout : fopen(temp, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", temp);
+        exit(1);
+    }
+    uint64_t start = STAT_CLOCK();
+    int format = to_stdout ? FORMAT_PPM : output_format(filename);
+    long header = write_header(out, format);
+    write_rows(out, format, header, framebuffer, image, 0, image_height);
+    if (to_stdout ? fflush(out) != 0 : fclose(out) != 0) {
+        fprintf(stderr, "Error: Could not write file \"%s\"\n", filename);
+        exit(1);
+    }
+    if (!to_stdout && rename(temp, filename) != 0) {
+        fprintf(stderr, "Error: Could not write file \"%s\"\n", filename);
+        exit(1);
+    }
+    STAT_ADD(output_cycles, STAT_CLOCK() - start);
+}
+
+//renders the frame in refining stages, writing a preview after each one.
+//framebuffer and image must hold the whole frame.
+void render_progressive(char* filename) {
+    int step = PROGRESSIVE_STEP;
+    int blocks_x = image_width > 1 ? (image_width - 2) / step + 1 : 1;
+    int blocks_y = image_height > 1 ? (image_height - 2) / step + 1 : 1;
+    //active[] flags the blocks of the current step still being refined
+    //there are never more blocks than pixels, whatever the step
+    unsigned char* active = malloc(image_width * image_height);
+    unsigned char* next = malloc(image_width * image_height);
+    sampled = calloc(image_width * image_height, 1);
+    sample_list = malloc(sizeof(int) * image_width * image_height);
+    memset(active, 1, blocks_x * blocks_y);
+    reset_ray_budget();
+    for (;;) {
+        sample_count = 0;
+        for (int by = 0; by < blocks_y; by += 1) {
+            for (int bx = 0; bx < blocks_x; bx += 1) {
+                if (!active[by * blocks_x + bx]) {
+                    continue;
+                }
+                int x0 = bx * step, y0 = by * step;
+                int x1 = x0 + step < image_width ? x0 + step : image_width - 1;
+                int y1 = y0 + step < image_height ? y0 + step : image_height - 1;
+                queue_sample(x0, y0);
+                queue_sample(x1, y0);
+                queue_sample(x0, y1);
+                queue_sample(x1, y1);
+            }
+        }
+        render_samples();
+
+        //fill every active block and split the ones with an edge in them
+        int half = step / 2;
+        int next_x = image_width > 1 && half > 0 ? (image_width - 2) / half + 1 : 1;
+        int next_y = image_height > 1 && half > 0 ? (image_height - 2) / half + 1 : 1;
+        int refining = 0;
+        if (half > 0) {
+            memset(next, 0, next_x * next_y);
+        }
+        for (int by = 0; by < blocks_y; by += 1) {
+            for (int bx = 0; bx < blocks_x; bx += 1) {
+                if (!active[by * blocks_x + bx]) {
+                    continue;
+                }
+                int x0 = bx * step, y0 = by * step;
+                int x1 = x0 + step < image_width ? x0 + step : image_width - 1;
+                int y1 = y0 + step < image_height ? y0 + step : image_height - 1;
+                if (fill_block(x0, y0, x1, y1) || half == 0) {
+                    continue;
+                }
+                for (int cy = 2 * by; cy <= 2 * by + 1 && cy < next_y; cy += 1) {
+                    for (int cx = 2 * bx; cx <= 2 * bx + 1 && cx < next_x; cx += 1) {
+                        next[cy * next_x + cx] = 1;
+                        refining = 1;
+                    }
+                }
+            }
+        }
+        write_preview(filename);
+        if (!refining) {
+            break;
+        }
+        unsigned char* swap = active;
+        active = next;
+        next = swap;
+        step = half;
+        blocks_x = next_x;
+        blocks_y = next_y;
+    }
+    STAT_FLUSH();
+    free(active);
+    free(next);
+    free(sampled);
+    free(sample_list);
+}
+
+//Scene edits. Batch mode can move one sphere or one light between frames;
+//the frame is then brought up to date from the previous one and the
+//G-buffer instead of being rendered again. A pixel is retraced from scratch
+//only if its primary ray meets the sphere at its old or new place. Any
+//other pixel with a hit is reshaded when one of its shadow rays could have
+//changed (it crosses the old sphere, crosses the new one while unshadowed,
+//or leads to the moved light), tracing just those shadow rays again.
+#define EDIT_SPHERE 1
+#define EDIT_LIGHT 2
+
+typedef struct {
+    int kind;
+    int index;
+    real radius;
+    real old_center[3];
+    real new_center[3];
+} Edit;
+
+Edit current_edit;
+
+//refits the boxes below node n to the spheres they hold
+static void bvh_refit(int n) {
+    BVHNode* node = &bvh_nodes[n];
+    for (int a = 0; a < 3; a += 1) {
+        node->min[a] = INFINITY;
+        node->max[a] = -INFINITY;
+    }
+    if (node->count > 0) {
+        for (int i = node->left_first; i < node->left_first + node->count; i += 1) {
+            bvh_grow(node->min, node->max, spheres.id[i]);
+        }
+        return;
+    }
+    bvh_refit(node->left_first);
+    bvh_refit(node->left_first + 1);
+    for (int a = 0; a < 3; a += 1) {
+        BVHNode* left = &bvh_nodes[node->left_first];
+        BVHNode* right = &bvh_nodes[node->left_first + 1];
+        node->min[a] = left->min[a] < right->min[a] ? left->min[a] : right->min[a];
+        node->max[a] = left->max[a] > right->max[a] ? left->max[a] : right->max[a];
+    }
+}
+
+//moves sphere or light number index to v, given in scene file coordinates,
+//and updates the acceleration data and light tables to match
+void apply_edit(Edit* edit, int kind, int index, real* v) {
+    edit->kind = kind;
+    edit->index = index;
+    if (kind == EDIT_SPHERE) {
+        if (index < 0 || index >= object_count || objects[index]->kind != 1) {
+            fprintf(stderr, "Error: Object %d is not a sphere.\n", index);
+            exit(1);
+        }
+        Object* sphere = objects[index];
+        edit->radius = sphere->sphere.radius;
+        set_vector(edit->old_center, sphere->center);
+        sphere->center[0] = v[0];
+        sphere->center[1] = -v[1];
+        sphere->center[2] = v[2];
+        set_vector(edit->new_center, sphere->center);
+        for (int i = 0; i < spheres.count; i += 1) {
+            if (spheres.id[i] == index) {
+                spheres.x[i] = sphere->center[0];
+                spheres.y[i] = sphere->center[1];
+                spheres.z[i] = sphere->center[2];
+            }
+        }
+        bvh_refit(0);
+        if (use_grid) {
+            build_grid();
+        }
+    } else {
+        if (index < 0 || index >= light_count) {
+            fprintf(stderr, "Error: There is no light %d.\n", index);
+            exit(1);
+        }
+        set_vector(lights[index]->center, v);
+    }
+    free_lights();
+    compile_lights();
+}
+
+//true if the segment from Ro along Rd up to dl meets the sphere at C
+static inline int edit_crosses(real* Ro, real* Rd, real dl, real* C, real r) {
+    real t = sphere_intersection(Ro, Rd, C, r);
+    return t > shadow_epsilon && t <= dl;
+}
+
+//brings pixel (x, y) of the previous frame up to date after current_edit
+static void update_pixel(int x, int y) {
+    Edit* edit = &current_edit;
+    int index = y * image_width + x;
+    GPixel* g = &gbuffer[index];
+    real Ro[3];
+    real Rd[3];
+    real color[3];
+    primary_ray(x, y, Ro, Rd);
+    if (edit->kind == EDIT_SPHERE &&
+        (sphere_intersection(Ro, Rd, edit->old_center, edit->radius) > 0 ||
+         sphere_intersection(Ro, Rd, edit->new_center, edit->radius) > 0)) {
+        put_pixel(pixel_index(x, y), trace_primary(Ro, Rd, color, g, -1, 1) ? color : NULL);
+        return;
+    }
+    if (g->hit < 0) {
+        return;
+    }
+    ShadePoint sp;
+    shade_begin(&sp, Ro, Rd, g->t, g->hit);
+    uint64_t dirty = 0;
+    if (edit->kind == EDIT_LIGHT) {
+        dirty = 1ull << edit->index;
+    } else {
+        for (int j = 0; lights[j] != NULL; j += 1) {
+            if (!light_active[j]) {
+                continue;
+            }
+            real object_light[3];
+            real dl = light_ray(&sp, j, object_light);
+            if (edit_crosses(sp.position, object_light, dl, edit->old_center, edit->radius) ||
+                (!((g->shadowed >> j) & 1) &&
+                 edit_crosses(sp.position, object_light, dl, edit->new_center, edit->radius))) {
+                dirty |= 1ull << j;
+            }
+        }
+    }
+    if (dirty == 0) {
+        return;
+    }
+    shade_lights(&sp, g, dirty);
+    put_pixel(pixel_index(x, y), sp.color);
+}
+
+//worker loop for an edit: claims rows until none are left
+void* update_worker(void* arg) {
+    int y;
+    while ((y = atomic_fetch_add(&next_tile, 1)) < image_height) {
+        for (int x = 0; x < image_width; x += 1) {
+            update_pixel(x, y);
+        }
+    }
+    STAT_FLUSH();
+    return NULL;
+}
+
+//applies current_edit to the frame in image on num_threads threads. image
+//and gbuffer must hold the previous frame of the same view.
+void render_edit(void) {
+    pthread_t workers[MAX_THREADS];
+    atomic_store(&next_tile, 0);
+    for (int t = 1; t < num_threads; t += 1) {
+        if (pthread_create(&workers[t], NULL, update_worker, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start render thread.\n");
+            exit(1);
+        }
+    }
+    update_worker(NULL);
+    for (int t = 1; t < num_threads; t += 1) {
+        pthread_join(workers[t], NULL);
+    }
+}
+
+//Batch mode renders a sequence of frames in one process. Each line of the
+//frame script is one frame: a camera position "x y z" for the current
+//scene, an edit "sphere K x y z" or "light K x y z" that moves object or
+//light number K, or the path of a scene to switch to (rendered from its own
+//camera). The scene, its BVH and light tables stay loaded until a line
+//names a different scene, and edits are applied incrementally. Frames are
+//rendered into two buffers in turn, so frame N is written out by a writer
+//thread while frame N+1 renders.
+typedef struct {
+    float* radiance;
+    Pixel* pixels;
+    char filename[4096];
+    pthread_t thread;
+    int busy;
+} FrameWriter;
+
+//writer thread: runs the post pass on one finished frame and saves it
+void* frame_writer(void* arg) {
+    FrameWriter* writer = arg;
+    FILE* out = fopen(writer->filename, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", writer->filename);
+        exit(1);
+    }
+    uint64_t start = STAT_CLOCK();
+    int format = output_format(writer->filename);
+    long header = write_header(out, format);
+    write_rows(out, format, header, writer->radiance, writer->pixels, 0, image_height);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: Could not write file \"%s\"\n", writer->filename);
+        exit(1);
+    }
+    STAT_ADD(output_cycles, STAT_CLOCK() - start);
+    STAT_FLUSH();
+    return NULL;
+}
+
+//checks that pattern holds exactly one integer conversion such as %04d
+static int frame_pattern_ok(char* pattern) {
+    int conversions = 0;
+    for (char* p = pattern; *p != '\0'; p += 1) {
+        if (*p != '%') {
+            continue;
+        }
+        p += 1;
+        if (*p == '%') {
+            continue;
+        }
+        while (isdigit((unsigned char)*p)) {
+            p += 1;
+        }
+        if (*p != 'd') {
+            return 0;
+        }
+        conversions += 1;
+    }
+    return conversions == 1;
+}
+
+//renders every frame of the script to pattern with the frame number filled in
+void render_batch(char* scene_file, char* script_file, char* pattern) {
+    if (!frame_pattern_ok(pattern)) {
+        fprintf(stderr, "Error: The output pattern needs exactly one %%d for the frame number.\n");
+        exit(1);
+    }
+    FILE* script = fopen(script_file, "r");
+    if (script == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", script_file);
+        exit(1);
+    }
+    long frame_floats = 3 * (long)image_width * image_height;
+    float* buffers[2];
+    buffers[0] = malloc(sizeof(float) * frame_floats);
+    buffers[1] = malloc(sizeof(float) * frame_floats);
+    image_rows = image_height;
+    char current[4096];
+    snprintf(current, sizeof(current), "%s", scene_file);
+    real scene_camera[3];
+    memcpy(scene_camera, camera.center, sizeof(scene_camera));
+    FrameWriter writer;
+    writer.busy = 0;
+    writer.pixels = malloc(sizeof(Pixel) * image_width * image_height);
+    //the G-buffer is only kept for one sample per pixel
+    GPixel* frame_gbuffer = NULL;
+    if (samples_per_pixel == 1) {
+        frame_gbuffer = malloc(sizeof(GPixel) * image_width * image_height);
+    }
+    int gbuffer_valid = 0;
+    char row[4096];
+    int frame = 0;
+    while (fgets(row, sizeof(row), script) != NULL) {
+        row[strcspn(row, "\r\n")] = '\0';
+        char* text = row;
+        while (isspace((unsigned char)*text)) {
+            text += 1;
+        }
+        if (*text == '\0' || *text == '#') {
+            continue;
+        }
+        double v[3];
+        char extra;
+        char kind[16];
+        int index;
+        int incremental = 0;
+        if (sscanf(text, "%15s %d %lf %lf %lf %c", kind, &index, &v[0], &v[1], &v[2], &extra) == 5 &&
+            (strcmp(kind, "sphere") == 0 || strcmp(kind, "light") == 0)) {
+            real position[3] = {v[0], v[1], v[2]};
+            real epsilon = shadow_epsilon;
+            apply_edit(&current_edit, strcmp(kind, "sphere") == 0 ? EDIT_SPHERE : EDIT_LIGHT, index, position);
+            //the G-buffer's shadows were found with the old epsilon, so an
+            //edit that changes it renders the frame again
+            incremental = gbuffer_valid && shadow_epsilon == epsilon;
+        } else if (sscanf(text, "%lf %lf %lf %c", &v[0], &v[1], &v[2], &extra) == 3) {
+            camera.center[0] = v[0];
+            camera.center[1] = v[1];
+            camera.center[2] = v[2];
+        } else {
+            if (strcmp(text, current) != 0) {
+                unload_scene();
+                load_scene(text);
+                snprintf(current, sizeof(current), "%s", text);
+                memcpy(scene_camera, camera.center, sizeof(scene_camera));
+                pixheight = camera.camera.height / image_height;
+                pixwidth = camera.camera.width / image_width;
+            }
+            set_vector(camera.center, scene_camera);
+        }
+
+        //a reflection can show a moved sphere anywhere, so edits rerender
+        gbuffer = light_count <= GBUFFER_LIGHTS && reflect_depth == 0 ? frame_gbuffer : NULL;
+        framebuffer = buffers[frame & 1];
+        if (incremental) {
+            memcpy(framebuffer, buffers[(frame + 1) & 1], sizeof(float) * frame_floats);
+            render_edit();
+        } else {
+            render_image(NULL, FORMAT_PPM, 0);
+        }
+        gbuffer_valid = gbuffer != NULL;
+        if (writer.busy) {
+            pthread_join(writer.thread, NULL);
+        }
+        writer.radiance = framebuffer;
+        snprintf(writer.filename, sizeof(writer.filename), pattern, frame);
+        if (pthread_create(&writer.thread, NULL, frame_writer, &writer) != 0) {
+            fprintf(stderr, "Error: Could not start the frame writer.\n");
+            exit(1);
+        }
+        writer.busy = 1;
+        frame += 1;
+    }
+    if (writer.busy) {
+        pthread_join(writer.thread, NULL);
+    }
+    if (frame == 0) {
+        fprintf(stderr, "Error: Frame script \"%s\" has no frames.\n", script_file);
+        exit(1);
+    }
+    fclose(script);
+    free(buffers[0]);
+    free(buffers[1]);
+    free(writer.pixels);
+    free(frame_gbuffer);
+    framebuffer = NULL;
+    gbuffer = NULL;
+}
+
+//prints the counters gathered by a --stats build as JSON
+void print_stats(FILE* out) {
+    RenderStats* s = &render_stats;
+    uint64_t total = s->primary_cycles + s->shadow_cycles + s->shade_cycles + s->output_cycles;
+    if (total == 0) {
+        total = 1;
+    }
+    fprintf(out, "{\"primary_rays\": %llu, \"shadow_rays\": %llu, \"shadow_culled\": %llu, \"shadow_early_outs\": %llu, \"occluder_cache_hits\": %llu,\n",
+            (unsigned long long)s->primary_rays, (unsigned long long)s->shadow_rays, (unsigned long long)s->shadow_culled,
+            (unsigned long long)s->shadow_early_outs, (unsigned long long)s->occluder_cache_hits);
+    fprintf(out, " \"sphere_tests\": %llu, \"plane_tests\": %llu, \"box_tests\": %llu, \"grid_cells\": %llu, \"mailbox_hits\": %llu,\n",
+            (unsigned long long)s->sphere_tests, (unsigned long long)s->plane_tests,
+            (unsigned long long)s->box_tests, (unsigned long long)s->grid_cells,
+            (unsigned long long)s->mailbox_hits);
+    fprintf(out, " \"reflection_rays\": %llu, \"reflections_dropped\": %llu,\n",
+            (unsigned long long)s->reflection_rays, (unsigned long long)s->reflections_dropped);
+    fprintf(out, " \"cycles\": {\"primary\": %llu, \"shadow\": %llu, \"shade\": %llu, \"output\": %llu},\n",
+            (unsigned long long)s->primary_cycles, (unsigned long long)s->shadow_cycles,
+            (unsigned long long)s->shade_cycles, (unsigned long long)s->output_cycles);
+    fprintf(out, " \"percent\": {\"primary\": %.1f, \"shadow\": %.1f, \"shade\": %.1f, \"output\": %.1f}}\n",
+            100.0 * s->primary_cycles / total, 100.0 * s->shadow_cycles / total,
+            100.0 * s->shade_cycles / total, 100.0 * s->output_cycles / total);
+}
+
+//Benchmark driver. "raycast bench" writes a procedurally generated scene,
+//then times parsing, acceleration build, primary rays, shadow rays, the
+//full shaded render and PPM output separately and prints the numbers as
+//one JSON object so runs can be compared across builds.
+typedef struct {
+    int spheres;
+    int lights;
+    int planes;
+    int width;
+    int height;
+    unsigned seed;
+} BenchConfig;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//small deterministic generator so every build sees the same scene
+static double bench_random(unsigned* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return (*state >> 8) / 16777216.0;
+}
+
+//writes a random scene in the Test.json format to path
+static void bench_write_scene(const char* path, BenchConfig* config) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", path);
+        exit(1);
+    }
+    unsigned state = config->seed;
+    fprintf(out, "[\n{\"type\": \"camera\", \"width\": 2.0, \"height\": 2.0}");
+    for (int i = 0; i < config->spheres; i += 1) {
+        fprintf(out, ",\n{\"type\": \"sphere\", \"radius\": %.4f, \"diffuse_color\": [%.3f, %.3f, %.3f], "
+                "\"specular_color\": [1, 1, 1], \"position\": [%.4f, %.4f, %.4f]}",
+                0.05 + 0.25 * bench_random(&state), bench_random(&state), bench_random(&state),
+                bench_random(&state), -4 + 8 * bench_random(&state), -4 + 8 * bench_random(&state),
+                4 + 10 * bench_random(&state));
+    }
+    for (int i = 0; i < config->planes; i += 1) {
+        fprintf(out, ",\n{\"type\": \"plane\", \"normal\": [0, 1, 0], \"diffuse_color\": [0, 1, 0], "
+                "\"position\": [0, %d, 0]}", -1 - 4 * i);
+    }
+    for (int j = 0; j < config->lights; j += 1) {
+        fprintf(out, ",\n{\"type\": \"light\", \"color\": [1, 1, 1], \"theta\": 0, \"radial-a2\": 0.125, "
+                "\"radial-a1\": 0.125, \"radial-a0\": 0.125, \"position\": [%.4f, %.4f, %.4f]}",
+                -4 + 8 * bench_random(&state), -4 + 8 * bench_random(&state), 4 * bench_random(&state));
+    }
+    fprintf(out, "\n]\n");
+    fclose(out);
+}
+
+//primary hits from the ray phase, reused to aim the shadow phase
+int* bench_hit;
+real* bench_t;
+atomic_long bench_shadow_rays;
+
+//traces the primary ray of every pixel in rows claimed from next_tile
+static void* bench_primary_worker(void* arg) {
+    int y;
+    while ((y = atomic_fetch_add(&next_tile, 1)) < image_height) {
+        for (int x = 0; x < image_width; x += 1) {
+            real Ro[3], Rd[3];
+            primary_ray(x, y, Ro, Rd);
+            bench_hit[y * image_width + x] = closest_hit(Ro, Rd, &bench_t[y * image_width + x]);
+        }
+    }
+    return NULL;
+}
+
+//traces one shadow ray per light from every primary hit
+static void* bench_shadow_worker(void* arg) {
+    int y;
+    long rays = 0;
+    while ((y = atomic_fetch_add(&next_tile, 1)) < image_height) {
+        for (int x = 0; x < image_width; x += 1) {
+            int hit = bench_hit[y * image_width + x];
+            if (hit < 0) {
+                continue;
+            }
+            real Ro[3], Rd[3];
+            primary_ray(x, y, Ro, Rd);
+            ShadePoint sp;
+            shade_begin(&sp, Ro, Rd, bench_t[y * image_width + x], hit);
+            for (int j = 0; lights[j] != NULL; j += 1) {
+                real object_light[3];
+                real dl = light_ray(&sp, j, object_light);
+                occluded(sp.position, object_light, dl, hit);
+                rays += 1;
+            }
+        }
+    }
+    atomic_fetch_add(&bench_shadow_rays, rays);
+    return NULL;
+}
+
+//runs worker on num_threads threads over a freshly reset row counter
+static void bench_run(void* (*worker)(void*)) {
+    pthread_t workers[MAX_THREADS];
+    atomic_store(&next_tile, 0);
+    for (int t = 1; t < num_threads; t += 1) {
+        if (pthread_create(&workers[t], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start render thread.\n");
+            exit(1);
+        }
+    }
+    worker(NULL);
+    for (int t = 1; t < num_threads; t += 1) {
+        pthread_join(workers[t], NULL);
+    }
+}
+
+int bench_main(int argc, char** argv) {
+    BenchConfig config = {10000, 4, 1, 1024, 1024, 1};
+    for (int a = 2; a < argc; a += 1) {
+        int* field = NULL;
+        if (strcmp(argv[a], "--packets") == 0) {
+            use_packets = 1;
+            continue;
+        }
+        //the seed is unsigned, so it is read whole rather than through atoi
+        if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            config.seed = (unsigned)strtoul(argv[++a], NULL, 10);
+            continue;
+        }
+        if (strcmp(argv[a], "--spheres") == 0) field = &config.spheres;
+        else if (strcmp(argv[a], "--lights") == 0) field = &config.lights;
+        else if (strcmp(argv[a], "--planes") == 0) field = &config.planes;
+        else if (strcmp(argv[a], "--width") == 0) field = &config.width;
+        else if (strcmp(argv[a], "--height") == 0) field = &config.height;
+        else if (strcmp(argv[a], "--threads") == 0) field = &num_threads;
+        if (field == NULL || a + 1 >= argc) {
+            fprintf(stderr, "Please put the commands in the following format: bench [--packets] [--spheres N] [--lights N] [--planes N] [--width N] [--height N] [--threads N] [--seed N].");
+            exit(1);
+        }
+        *field = atoi(argv[++a]);
+    }
+    if (config.width <= 0 || config.height <= 0 || num_threads <= 0 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "Please make Height, Width and the thread count positive integers, with at most %d threads.", MAX_THREADS);
+        exit(1);
+    }
+    char scene_path[] = "/tmp/raycast-bench-XXXXXX";
+    int fd = mkstemp(scene_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create a temporary scene file.\n");
+        exit(1);
+    }
+    close(fd);
+    bench_write_scene(scene_path, &config);
+
+    double t0 = now_seconds();
+    read_scene(scene_path);
+    double t1 = now_seconds();
+    build_bvh();
+    compile_scene();
+    compile_lights();
+    select_kernels(0);
+    double t2 = now_seconds();
+    unlink(scene_path);
+
+    image_width = config.width;
+    image_height = config.height;
+    image_rows = image_height;
+    pixheight = camera.camera.height / image_height;
+    pixwidth = camera.camera.width / image_width;
+    long pixels = (long)image_width * image_height;
+    bench_hit = malloc(sizeof(int) * pixels);
+    bench_t = malloc(sizeof(real) * pixels);
+    image = malloc(sizeof(Pixel) * pixels);
+    framebuffer = malloc(sizeof(float) * 3 * pixels);
+
+    bench_run(bench_primary_worker);
+    double t3 = now_seconds();
+    atomic_store(&bench_shadow_rays, 0);
+    bench_run(bench_shadow_worker);
+    double t4 = now_seconds();
+    render_image(NULL, FORMAT_PPM, 0);
+    double t5 = now_seconds();
+    char image_path[] = "/tmp/raycast-bench-XXXXXX";
+    fd = mkstemp(image_path);
+    FILE* out = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Could not create a temporary image file.\n");
+        if (fd >= 0) {
+            close(fd);
+            unlink(image_path);
+        }
+        exit(1);
+    }
+    write_rows(out, FORMAT_PPM, write_header(out, FORMAT_PPM), framebuffer, image, 0, image_height);
+    fflush(out);
+    fsync(fileno(out));
+    fclose(out);
+    double t6 = now_seconds();
+    unlink(image_path);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long shadow_rays = atomic_load(&bench_shadow_rays);
+    printf("{\"spheres\": %d, \"lights\": %d, \"planes\": %d, \"width\": %d, \"height\": %d, \"threads\": %d, \"packets\": %d,\n",
+           config.spheres, config.lights, config.planes, image_width, image_height, num_threads, use_packets);
+    printf(" \"parse_s\": %.6f, \"build_s\": %.6f, \"primary_s\": %.6f, \"shadow_s\": %.6f, \"render_s\": %.6f, \"output_s\": %.6f,\n",
+           t1 - t0, t2 - t1, t3 - t2, t4 - t3, t5 - t4, t6 - t5);
+    printf(" \"primary_rays\": %ld, \"shadow_rays\": %ld,\n", pixels, shadow_rays);
+    printf(" \"primary_mrays_per_s\": %.3f, \"shadow_mrays_per_s\": %.3f, \"render_ns_per_pixel\": %.1f,\n",
+           pixels / (t3 - t2) / 1e6, shadow_rays / (t4 - t3) / 1e6, (t5 - t4) * 1e9 / pixels);
+    printf(" \"peak_rss_kb\": %ld}\n", usage.ru_maxrss);
+    return 0;
+}
+
+//Render server. raycast serve SOCKET listens on a Unix domain socket and
+//answers one request per connection:
+//  RENDER width height path         a scene file on the server's disk
+//  INLINE width height bytes        followed by that many bytes of JSON
+//  STATS                            the server counters as JSON
+//A render is answered with the PPM, a failure with a line starting with
+//ERROR. Connection threads read the requests and put them on a bounded
+//queue; the main thread takes them off in order and renders each one on
+//the whole thread pool. A request holds its queue slot from before its
+//scene is read, so at most queue_capacity inline scenes are in memory
+//waiting, and at most queue_capacity + CONNECTION_SLACK connections are
+//open at once; the rest are told the server is busy. Parsed scenes stay in
+//an LRU cache keyed by a hash of their contents, so a repeated scene skips
+//the parse and BVH build. A scene file is hashed when its request is read
+//but loaded later, so it is hashed again after loading; if it changed in
+//between, the load is retried up to LOAD_ATTEMPTS times under the new hash.
+#define REQUEST_LINE 4096
+#define LATENCY_WINDOW 1024
+#define MAX_INLINE_SCENE (256 << 20)
+#define MAX_REQUEST_PIXELS (1L << 28)
+#define CONNECTION_SLACK 16
+#define LOAD_ATTEMPTS 3
+
+typedef struct {
+    int fd;
+    int width;
+    int height;
+    char path[REQUEST_LINE];
+    char* data;
+    size_t size;
+    uint64_t hash;
+    double start;
+} Job;
+
+//Every global that makes up a loaded scene. A cached scene is moved out of
+//these into a Scene while another one is being rendered.
+#define SCENE_GLOBALS \
+    X(Object**, objects) X(Object**, lights) X(int, object_count) X(int, light_count) \
+    X(Object, camera) X(BVHNode*, bvh_nodes) X(int, bvh_node_count) X(int*, bvh_prims) \
+    X(int, bvh_prim_count) X(int*, plane_list) X(int, plane_count) \
+    X(SphereStore, spheres) X(PlaneStore, planes) X(Material*, materials) \
+    X(LightRecord*, light_table) X(unsigned char*, light_active) \
+    X(real, shadow_epsilon) \
+    X(char*, scene_map) X(size_t, scene_map_size) X(Arena, scene_arena) \
+    X(GridShape, grid) X(int*, grid_start) X(int*, grid_items)
+
+typedef struct {
+#define X(type, name) type name;
+    SCENE_GLOBALS
+#undef X
+} Scene;
+
+//moves the loaded scene out of the globals into s, leaving them empty
+static void stash_scene(Scene* s) {
+#define X(type, name) s->name = name; memset(&name, 0, sizeof(name));
+    SCENE_GLOBALS
+#undef X
+}
+
+//makes s the loaded scene
+static void restore_scene(Scene* s) {
+#define X(type, name) name = s->name;
+    SCENE_GLOBALS
+#undef X
+}
+
+typedef struct {
+    int valid;
+    uint64_t hash;
+    long used;
+    Scene scene;
+} CacheEntry;
+
+CacheEntry* scene_cache;
+int cache_size = 8;
+long cache_clock;
+
+Job** job_queue;
+int queue_capacity = 16;
+int queue_head;
+int queue_count;
+//slots held by requests whose scene is still being read
+int queue_reserved;
+atomic_int open_connections;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+//server counters, guarded by server_lock; latency keeps the last
+//LATENCY_WINDOW request times in seconds
+struct {
+    long requests;
+    long errors;
+    long cache_hits;
+    long cache_misses;
+    long latency_count;
+    double latency[LATENCY_WINDOW];
+} server_stats;
+pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//64-bit FNV-1a
+static uint64_t hash_bytes(const char* data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i += 1) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+//A manifest's own text does not change when one of its chunks does, so
+//the size and modification time of every chunk it lists are folded into
+//its hash; returns 0 if the manifest or a chunk cannot be read
+static int hash_chunks(char* path, char* data, size_t size, uint64_t* hash) {
+    Arena arena;
+    memset(&arena, 0, sizeof(arena));
+    jmp_buf recover;
+    volatile int ok = 0;
+    if (setjmp(recover) == 0) {
+        scene_recover = &recover;
+        Json json;
+        json.base = data;
+        json.pos = data;
+        json.size = size;
+        json.end = data + size;
+        line = 1;
+        skip_ws(&json);
+        expect_c(&json, '{');
+        int count;
+        SceneChunk* chunks = read_chunk_list(&json, path, &arena, &count);
+        ok = 1;
+        for (int i = 0; i < count && ok; i += 1) {
+            struct stat st;
+            ok = stat(chunks[i].path, &st) == 0;
+            uint64_t fields[4] = {*hash, (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec};
+            *hash = hash_bytes((const char*)fields, sizeof(fields));
+        }
+    }
+    scene_recover = NULL;
+    arena_free(&arena);
+    return ok;
+}
+
+//hashes the contents of a file, and for a manifest the state of its
+//chunks; returns 0 if it cannot be read
+static int hash_file(char* path, uint64_t* hash) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    *hash = hash_bytes("", 0);
+    if (st.st_size > 0) {
+        char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        *hash = hash_bytes(data, st.st_size);
+        size_t start = 0;
+        while (start < (size_t)st.st_size && isspace((unsigned char)data[start])) {
+            start += 1;
+        }
+        int ok = start == (size_t)st.st_size || data[start] != '{' || hash_chunks(path, data, st.st_size, hash);
+        munmap(data, st.st_size);
+        if (!ok) {
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+    return 1;
+}
+
+//reads exactly size bytes from fd
+static int read_full(int fd, char* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, buffer, size);
+        if (n <= 0) {
+            return 0;
+        }
+        buffer += n;
+        size -= n;
+    }
+    return 1;
+}
+
+//writes all of buffer to fd
+static int write_full(int fd, const char* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buffer, size);
+        if (n <= 0) {
+            return 0;
+        }
+        buffer += n;
+        size -= n;
+    }
+    return 1;
+}
+
+//reads one newline-terminated line of at most REQUEST_LINE - 1 bytes
+static int read_line(int fd, char* line_buffer) {
+    int i = 0;
+    while (i < REQUEST_LINE - 1) {
+        char c;
+        if (read(fd, &c, 1) != 1) {
+            return 0;
+        }
+        if (c == '\n') {
+            line_buffer[i] = '\0';
+            return 1;
+        }
+        line_buffer[i++] = c;
+    }
+    return 0;
+}
+
+//answers a request with an error and closes the connection
+static void reply_error(int fd, const char* message) {
+    char reply[REQUEST_LINE];
+    int n = snprintf(reply, sizeof(reply), "ERROR %s\n", message);
+    write_full(fd, reply, n);
+    close(fd);
+    pthread_mutex_lock(&server_lock);
+    server_stats.requests += 1;
+    server_stats.errors += 1;
+    pthread_mutex_unlock(&server_lock);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+//answers a STATS request
+static void reply_stats(int fd) {
+    double sorted[LATENCY_WINDOW];
+    pthread_mutex_lock(&server_lock);
+    int n = server_stats.latency_count < LATENCY_WINDOW ? server_stats.latency_count : LATENCY_WINDOW;
+    memcpy(sorted, server_stats.latency, sizeof(double) * n);
+    long requests = server_stats.requests, errors = server_stats.errors;
+    long hits = server_stats.cache_hits, misses = server_stats.cache_misses;
+    pthread_mutex_unlock(&server_lock);
+    pthread_mutex_lock(&queue_lock);
+    int queued = queue_count;
+    pthread_mutex_unlock(&queue_lock);
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    double q[4] = {0.5, 0.9, 0.99, 1};
+    double ms[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4 && n > 0; i += 1) {
+        ms[i] = sorted[(int)ceil(q[i] * n) - 1] * 1000;
+    }
+    char reply[REQUEST_LINE];
+    int len = snprintf(reply, sizeof(reply),
+        "{\"requests\": %ld, \"errors\": %ld, \"cache_hits\": %ld, \"cache_misses\": %ld, \"queued\": %d,\n"
+        " \"latency_ms\": {\"samples\": %d, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n",
+        requests, errors, hits, misses, queued, n, ms[0], ms[1], ms[2], ms[3]);
+    write_full(fd, reply, len);
+    close(fd);
+}
+
+//gives back a queue slot taken by reserve_slot()
+static void release_slot(void) {
+    pthread_mutex_lock(&queue_lock);
+    queue_reserved -= 1;
+    pthread_cond_signal(&queue_not_full);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+//waits for a free queue slot and holds it for a request being read
+static void reserve_slot(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count + queue_reserved == queue_capacity) {
+        pthread_cond_wait(&queue_not_full, &queue_lock);
+    }
+    queue_reserved += 1;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+//reads one request and queues it for the renderer
+static void read_request(int fd) {
+    char request[REQUEST_LINE];
+    Job* job = calloc(1, sizeof(Job));
+    job->fd = fd;
+    job->start = now_seconds();
+    size_t size;
+    if (!read_line(fd, request)) {
+        reply_error(fd, "request line missing or too long");
+        free(job);
+        return;
+    }
+    if (strcmp(request, "STATS") == 0) {
+        reply_stats(fd);
+        free(job);
+        return;
+    }
+    if (sscanf(request, "RENDER %d %d %4095[^\n]", &job->width, &job->height, job->path) == 3) {
+        reserve_slot();
+        if (!hash_file(job->path, &job->hash)) {
+            release_slot();
+            reply_error(fd, "could not read the scene file");
+            free(job);
+            return;
+        }
+    } else if (sscanf(request, "INLINE %d %d %zu", &job->width, &job->height, &size) == 3 &&
+               size <= MAX_INLINE_SCENE) {
+        reserve_slot();
+        job->data = malloc(size + 1);
+        job->size = size;
+        if (!read_full(fd, job->data, size)) {
+            release_slot();
+            reply_error(fd, "scene shorter than its stated size");
+            free(job->data);
+            free(job);
+            return;
+        }
+        job->hash = hash_bytes(job->data, size);
+    } else {
+        reply_error(fd, "bad request");
+        free(job);
+        return;
+    }
+    if (job->width <= 0 || job->height <= 0 || (long)job->width * job->height > MAX_REQUEST_PIXELS) {
+        release_slot();
+        reply_error(fd, "bad image size");
+        free(job->data);
+        free(job);
+        return;
+    }
+    pthread_mutex_lock(&queue_lock);
+    queue_reserved -= 1;
+    job_queue[(queue_head + queue_count) % queue_capacity] = job;
+    queue_count += 1;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+//connection thread
+void* serve_connection(void* arg) {
+    read_request((int)(intptr_t)arg);
+    atomic_fetch_sub(&open_connections, 1);
+    return NULL;
+}
+
+//accept loop, one detached thread per connection
+void* serve_accept(void* arg) {
+    int listener = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (atomic_fetch_add(&open_connections, 1) >= queue_capacity + CONNECTION_SLACK) {
+            atomic_fetch_sub(&open_connections, 1);
+            reply_error(fd, "server busy");
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void*)(intptr_t)fd) != 0) {
+            atomic_fetch_sub(&open_connections, 1);
+            reply_error(fd, "server busy");
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+//loads the job's scene into the globals; on a bad scene everything the
+//failed load built is dropped and 0 is returned
+static int server_load(Job* job) {
+    jmp_buf recover;
+    if (setjmp(recover) != 0) {
+        scene_recover = NULL;
+        if (json_map != NULL) {
+            munmap((void*)json_map, json_map_size);
+            json_map = NULL;
+        }
+        if (scene_map != NULL) {
+            munmap(scene_map, scene_map_size);
+        }
+        arena_free(&scene_arena);
+        Scene empty;
+        memset(&empty, 0, sizeof(empty));
+        restore_scene(&empty);
+        return 0;
+    }
+    scene_recover = &recover;
+    if (job->data != NULL) {
+        Json json;
+        json.base = job->data;
+        json.pos = json.base;
+        json.size = job->size;
+        json.end = json.base + json.size;
+        SceneParse ps;
+        parse_scene(&json, &ps, &scene_arena);
+        use_parsed_scene(&ps);
+        build_bvh();
+        compile_scene();
+        if (use_grid) {
+            build_grid();
+        }
+        compile_lights();
+    } else {
+        load_scene(job->path);
+    }
+    scene_recover = NULL;
+    return 1;
+}
+
+//loads the job's scene and makes sure job->hash is the hash of what was
+//parsed; returns 0 for a bad scene or one that keeps changing
+static int server_load_checked(Job* job) {
+    for (int attempt = 0; attempt < LOAD_ATTEMPTS; attempt += 1) {
+        if (!server_load(job)) {
+            return 0;
+        }
+        uint64_t hash;
+        if (job->data != NULL || (hash_file(job->path, &hash) && hash == job->hash)) {
+            return 1;
+        }
+        unload_scene();
+        Scene empty;
+        memset(&empty, 0, sizeof(empty));
+        restore_scene(&empty);
+        if (!hash_file(job->path, &job->hash)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+//finds the job's scene in the cache, loading it into the least recently
+//used slot on a miss; returns the slot or -1 for a bad scene
+static int server_scene(Job* job) {
+    int slot = -1;
+    for (int i = 0; i < cache_size; i += 1) {
+        if (scene_cache[i].valid && scene_cache[i].hash == job->hash) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        pthread_mutex_lock(&server_lock);
+        server_stats.cache_hits += 1;
+        pthread_mutex_unlock(&server_lock);
+        restore_scene(&scene_cache[slot].scene);
+    } else {
+        slot = 0;
+        for (int i = 1; i < cache_size; i += 1) {
+            if (!scene_cache[slot].valid) {
+                break;
+            }
+            if (!scene_cache[i].valid || scene_cache[i].used < scene_cache[slot].used) {
+                slot = i;
+            }
+        }
+        if (scene_cache[slot].valid) {
+            restore_scene(&scene_cache[slot].scene);
+            unload_scene();
+            scene_cache[slot].valid = 0;
+        }
+        if (!server_load_checked(job)) {
+            return -1;
+        }
+        pthread_mutex_lock(&server_lock);
+        server_stats.cache_misses += 1;
+        pthread_mutex_unlock(&server_lock);
+        scene_cache[slot].valid = 1;
+        scene_cache[slot].hash = job->hash;
+    }
+    scene_cache[slot].used = ++cache_clock;
+    return slot;
+}
+
+//renders one job and streams the PPM back on its connection
+static void serve_job(Job* job) {
+    int slot = server_scene(job);
+    if (slot < 0) {
+        reply_error(job->fd, "could not load the scene");
+        return;
+    }
+    image_width = job->width;
+    image_height = job->height;
+    pixheight = camera.camera.height / image_height;
+    pixwidth = camera.camera.width / image_width;
+    ring_bands = 2 * num_threads + 2;
+    image_rows = ring_bands * TILE_SIZE;
+    if (image_rows > image_height) {
+        image_rows = image_height;
+    }
+    image = realloc(image, sizeof(Pixel) * image_rows * image_width);
+    framebuffer = realloc(framebuffer, sizeof(float) * 3 * image_rows * image_width);
+    FILE* out = fdopen(job->fd, "wb");
+    render_image(out, FORMAT_PPM, write_header(out, FORMAT_PPM));
+    fclose(out);
+    stash_scene(&scene_cache[slot].scene);
+
+    double elapsed = now_seconds() - job->start;
+    pthread_mutex_lock(&server_lock);
+    server_stats.requests += 1;
+    server_stats.latency[server_stats.latency_count % LATENCY_WINDOW] = elapsed;
+    server_stats.latency_count += 1;
+    pthread_mutex_unlock(&server_lock);
+}
+
+//raycast serve [options] SOCKET: runs the server until it is killed
+int serve_main(char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path \"%s\" is too long.\n", socket_path);
+        exit(1);
+    }
+    strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 64) != 0) {
+        fprintf(stderr, "Error: Could not listen on \"%s\".\n", socket_path);
+        exit(1);
+    }
+    //a client that hangs up mid-image must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    scene_cache = calloc(cache_size, sizeof(CacheEntry));
+    job_queue = malloc(sizeof(Job*) * queue_capacity);
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, serve_accept, (void*)(intptr_t)listener) != 0) {
+        fprintf(stderr, "Error: Could not start the server thread.\n");
+        exit(1);
+    }
+    fprintf(stderr, "Listening on %s\n", socket_path);
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_count == 0) {
+            pthread_cond_wait(&queue_not_empty, &queue_lock);
+        }
+        Job* job = job_queue[queue_head];
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_count -= 1;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_lock);
+        serve_job(job);
+        free(job->data);
+        free(job);
+    }
+    return 0;
+}
+
+//connects to the server at socket_path
+static int client_connect(char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: Could not connect to \"%s\".\n", socket_path);
+        exit(1);
+    }
+    return fd;
+}
+
+//copies the server's reply to out; an ERROR reply goes to stderr instead
+static void client_reply(int fd, FILE* out) {
+    char buffer[1 << 16];
+    ssize_t n;
+    int first = 1;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (first && n >= 5 && memcmp(buffer, "ERROR", 5) == 0) {
+            fwrite(buffer, 1, n, stderr);
+            exit(1);
+        }
+        first = 0;
+        fwrite(buffer, 1, n, out);
+    }
+    if (first) {
+        fprintf(stderr, "Error: The server closed the connection without a reply.\n");
+        exit(1);
+    }
+}
+
+//raycast client SOCKET stats
+//raycast client SOCKET [--inline] [--repeat N] width height scene output
+int client_main(int argc, char** argv) {
+    char* args[5];
+    int nargs = 0;
+    int send_inline = 0;
+    int repeat = 1;
+    for (int a = 2; a < argc; a += 1) {
+        if (strcmp(argv[a], "--inline") == 0) {
+            send_inline = 1;
+        } else if (strcmp(argv[a], "--repeat") == 0 && a + 1 < argc) {
+            repeat = atoi(argv[++a]);
+        } else if (nargs < 5) {
+            args[nargs++] = argv[a];
+        } else {
+            nargs++;
+        }
+    }
+    if (nargs == 2 && strcmp(args[1], "stats") == 0) {
+        int fd = client_connect(args[0]);
+        write_full(fd, "STATS\n", 6);
+        client_reply(fd, stdout);
+        close(fd);
+        return 0;
+    }
+    if (nargs != 5 || repeat <= 0) {
+        fprintf(stderr, "Please put the commands in the following format: client, socket, stats or client, socket, [--inline] [--repeat N] width, height, scene file, destination file.");
+        exit(1);
+    }
+    char* data = NULL;
+    size_t size = 0;
+    if (send_inline) {
+        FILE* scene = fopen(args[3], "rb");
+        if (scene == NULL) {
+            fprintf(stderr, "Error: Could not open file \"%s\"\n", args[3]);
+            exit(1);
+        }
+        fseek(scene, 0, SEEK_END);
+        size = ftell(scene);
+        fseek(scene, 0, SEEK_SET);
+        data = malloc(size + 1);
+        if (fread(data, 1, size, scene) != size) {
+            fprintf(stderr, "Error: Could not read file \"%s\"\n", args[3]);
+            exit(1);
+        }
+        fclose(scene);
+    }
+    for (int r = 0; r < repeat; r += 1) {
+        int fd = client_connect(args[0]);
+        char request[REQUEST_LINE];
+        int n = send_inline
+            ? snprintf(request, sizeof(request), "INLINE %s %s %zu\n", args[1], args[2], size)
+            : snprintf(request, sizeof(request), "RENDER %s %s %s\n", args[1], args[2], args[3]);
+        if (n >= (int)sizeof(request) || !write_full(fd, request, n) ||
+            (send_inline && !write_full(fd, data, size))) {
+            fprintf(stderr, "Error: Could not send the request.\n");
+            exit(1);
+        }
+        FILE* out = strcmp(args[4], "-") == 0 ? stdout : fopen(args[4], "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error: Could not open file \"%s\"\n", args[4]);
+            exit(1);
+        }
+        client_reply(fd, out);
+        close(fd);
+        if (out != stdout && fclose(out) != 0) {
+            fprintf(stderr, "Error: Could not write file \"%s\"\n", args[4]);
+            exit(1);
+        }
+    }
+    free(data);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    FILE* outputfile;
+    char* args[5];
+    int nargs = 0;
+    int force_scalar = 0;
+    int show_stats = 0;
+    int progressive = 0;
+    int tiled_output = 0;
+    //raycast batch [options] width height scene script pattern
+    int batch = argc >= 2 && strcmp(argv[1], "batch") == 0;
+    //raycast serve [options] socket
+    int serve = argc >= 2 && strcmp(argv[1], "serve") == 0;
+    int positional = batch ? 5 : serve ? 1 : 4;
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > MAX_THREADS) {
+        num_threads = MAX_THREADS;
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return bench_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "client") == 0) {
+        return client_main(argc, argv);
+    }
+    //raycast compile scene.json scene.bin
+    if (argc >= 2 && strcmp(argv[1], "compile") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Please put the commands in the following format: compile, source file, destination file.");
+            exit(1);
+        }
+        load_scene(argv[2]);
+        write_binary_scene(argv[3]);
+        return 0;
+    }
+    for (int a = 1 + batch + serve; a < argc; a += 1) {
+        if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            num_threads = atoi(argv[++a]);
+            if (num_threads <= 0 || num_threads > MAX_THREADS) {
+                fprintf(stderr, "Please make the thread count a positive integer no larger than %d.", MAX_THREADS);
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--packets") == 0) {
+            use_packets = 1;
+        } else if (strcmp(argv[a], "--scalar") == 0) {
+            force_scalar = 1;
+        } else if (strcmp(argv[a], "--spp") == 0 && a + 1 < argc) {
+            samples_per_pixel = atoi(argv[++a]);
+            if (samples_per_pixel <= 0 || samples_per_pixel > MAX_SPP) {
+                fprintf(stderr, "Please make the sample count an integer from 1 to %d.", MAX_SPP);
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--progressive") == 0) {
+            progressive = 1;
+        } else if (strcmp(argv[a], "--accel") == 0 && a + 1 < argc) {
+            char* accel = argv[++a];
+            if (strcmp(accel, "bvh") == 0 || strcmp(accel, "grid") == 0) {
+                use_grid = strcmp(accel, "grid") == 0;
+            } else {
+                fprintf(stderr, "Please make the accelerator bvh or grid.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--reflect") == 0 && a + 1 < argc) {
+            reflect_depth = atoi(argv[++a]);
+            if (reflect_depth < 0) {
+                fprintf(stderr, "Please make the reflection depth a non-negative integer.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--energy") == 0 && a + 1 < argc) {
+            reflect_energy = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--ray-budget") == 0 && a + 1 < argc) {
+            ray_budget = atol(argv[++a]);
+            if (ray_budget < 0) {
+                fprintf(stderr, "Please make the ray budget a non-negative integer.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--tiled") == 0) {
+            tiled_output = 1;
+        } else if (strcmp(argv[a], "--threshold") == 0 && a + 1 < argc) {
+            refine_threshold = atoi(argv[++a]);
+            if (refine_threshold < 0) {
+                fprintf(stderr, "Please make the threshold a non-negative integer.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--exposure") == 0 && a + 1 < argc) {
+            //in stops: each one doubles the light
+            exposure = exp2(atof(argv[++a]));
+        } else if (strcmp(argv[a], "--tonemap") == 0 && a + 1 < argc) {
+            char* curve = argv[++a];
+            if (strcmp(curve, "clamp") == 0) {
+                tone_curve = TONE_CLAMP;
+            } else if (strcmp(curve, "reinhard") == 0) {
+                tone_curve = TONE_REINHARD;
+            } else if (strcmp(curve, "aces") == 0) {
+                tone_curve = TONE_ACES;
+            } else {
+                fprintf(stderr, "Please make the tone curve clamp, reinhard or aces.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--cache") == 0 && a + 1 < argc) {
+            cache_size = atoi(argv[++a]);
+            if (cache_size <= 0) {
+                fprintf(stderr, "Please make the cache size a positive integer.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--queue") == 0 && a + 1 < argc) {
+            queue_capacity = atoi(argv[++a]);
+            if (queue_capacity <= 0) {
+                fprintf(stderr, "Please make the queue length a positive integer.");
+                exit(1);
+            }
+        } else if (strcmp(argv[a], "--stats") == 0) {
+#ifndef RAYCAST_STATS
+            fprintf(stderr, "Error: --stats needs a build with counters (make STATS=1).\n");
+            exit(1);
+#endif
+            show_stats = 1;
+        } else if (nargs < positional) {
+            args[nargs++] = argv[a];
+        } else {
+            nargs++;
+        }
+    }
+    if (num_threads <= 0) {
+        num_threads = 1;
+    }
+    //checks for number of arguments
+    if (batch && nargs != 5) {
+        fprintf(stderr, "Please put the commands in the following format: batch [--threads N] [--scalar] [--packets] [--accel bvh|grid] [--spp N] [--reflect N] [--energy E] [--ray-budget N] [--exposure EV] [--tonemap curve] [--stats] width, height, scene file, frame script, output pattern.");
+        exit(1);
+    }
+    if (serve && nargs != 1) {
+        fprintf(stderr, "Please put the commands in the following format: serve [--threads N] [--scalar] [--packets] [--accel bvh|grid] [--spp N] [--reflect N] [--energy E] [--ray-budget N] [--exposure EV] [--tonemap curve] [--cache N] [--queue N] socket.");
+        exit(1);
+    }
+    if (serve) {
+        select_kernels(force_scalar);
+        build_sample_pattern();
+        return serve_main(args[0]);
+    }
+    if(nargs != positional){
+        fprintf(stderr, "Please put the commands in the following format: [--threads N] [--scalar] [--packets] [--accel bvh|grid] [--spp N] [--reflect N] [--energy E] [--ray-budget N] [--progressive] [--threshold N] [--tiled] [--exposure EV] [--tonemap curve] [--stats] width, height, source file, destination file.");
+        exit(1);
+    }
+    load_scene(args[2]);
+    select_kernels(force_scalar);
+    build_sample_pattern();
+  
+//grabs height and width of pixel
+  int M = atoi(args[1]);
+  int N = atoi(args[0]);
+  if(M <= 0 || N <= 0){
+      fprintf(stderr, "Please make Height and Width a positive integer.");
+      exit(1);
+  }
+  image_height = M;
+  image_width = N;
+  pixheight = camera.camera.height / M;
+  pixwidth = camera.camera.width / N;
+
+  if (batch) {
+      render_batch(args[2], args[3], args[4]);
+      if (show_stats) {
+          print_stats(stderr);
+      }
+      unload_scene();
+      return 0;
+  }
+
+  if (tiled_output) {
+      if (progressive || strcmp(args[3], "-") == 0) {
+          fprintf(stderr, "Error: --tiled writes to a file and cannot be combined with --progressive.\n");
+          exit(1);
+      }
+      render_tiled(args[3], args[2]);
+      if (show_stats) {
+          print_stats(stderr);
+      }
+      arena_free(&scene_arena);
+      return 0;
+  }
+
+  //progressive previews need the whole frame in memory
+  if (progressive) {
+      image_rows = M;
+      image = malloc(sizeof(Pixel)*M*N);
+      framebuffer = malloc(sizeof(float)*3*M*N);
+      render_progressive(args[3]);
+      if (show_stats) {
+          print_stats(stderr);
+      }
+      arena_free(&scene_arena);
+      return 0;
+  }
+
+  //only a ring of bands is kept in memory; "-" streams to stdout
+  ring_bands = 2 * num_threads + 2;
+  image_rows = ring_bands * TILE_SIZE;
+  if (image_rows > M) {
+      image_rows = M;
+  }
+  image = malloc(sizeof(Pixel)*image_rows*N);
+  framebuffer = malloc(sizeof(float)*3*image_rows*N);
+  outputfile = strcmp(args[3], "-") == 0 ? stdout : fopen(args[3], "wb");
+  if (outputfile == NULL) {
+      fprintf(stderr, "Error: Could not open file \"%s\"\n", args[3]);
+      exit(1);
+  }
+  int format = outputfile == stdout ? FORMAT_PPM : output_format(args[3]);
+  long header = write_header(outputfile, format);
+  
+  //Set the objects into the proper place and stream the image pixels out
+  render_image(outputfile, format, header);
+  if (fclose(outputfile) != 0) {
+      fprintf(stderr, "Error: Could not write file \"%s\"\n", args[3]);
+      exit(1);
+  }
+  if (show_stats) {
+      print_stats(stderr);
+  }
+  arena_free(&scene_arena);
+  return 0;
+}
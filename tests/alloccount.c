@@ -0,0 +1,32 @@
+//alloccount.so, loaded with LD_PRELOAD
+//Counts every malloc, calloc and realloc the process makes and prints the
+//total to stderr as "allocations N" when it exits. Uses glibc's __libc_*
+//entry points, so it needs no dlsym and works from the first allocation.
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+static atomic_long allocations;
+
+void* malloc(size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_realloc(pointer, size);
+}
+
+__attribute__((destructor)) static void report(void) {
+    fprintf(stderr, "allocations %ld\n", atomic_load(&allocations));
+}
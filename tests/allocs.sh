@@ -0,0 +1,34 @@
+#!/bin/sh
+# Checks that the render loop allocates nothing per pixel. Each mode renders
+# the same scene at 200x150 and at 400x300 under tests/alloccount.so, and
+# the two runs must make the same number of heap allocations: setup may
+# allocate, but four times the pixels must not mean more allocations.
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+count=0
+while read -r options; do
+    count=$((count + 1))
+    # shellcheck disable=SC2086
+    small=$(LD_PRELOAD=./tests/alloccount.so ./raycast --threads 2 $options 200 150 tests/scenes/lights.json "$work/small.ppm" 2>&1 | sed -n 's/^allocations //p')
+    # shellcheck disable=SC2086
+    large=$(LD_PRELOAD=./tests/alloccount.so ./raycast --threads 2 $options 400 300 tests/scenes/lights.json "$work/large.ppm" 2>&1 | sed -n 's/^allocations //p')
+    if [ -n "$small" ] && [ "$small" = "$large" ]; then
+        echo "ok   allocations${options:+ $options}: $small at both sizes"
+    else
+        echo "FAIL allocations${options:+ $options}: ${small:-none} at 200x150, ${large:-none} at 400x300"
+        failed=$((failed + 1))
+    fi
+done <<MODES
+
+--packets
+--scalar
+--accel grid
+--tiled
+--progressive
+--spp 16
+--reflect 3
+MODES
+echo "$((count - failed)) of $count passed"
+[ $failed = 0 ]
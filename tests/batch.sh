@@ -0,0 +1,39 @@
+#!/bin/sh
+# Checks that batch mode's incremental edits render what a fresh render of
+# the edited scene does, in both the double and the float build. Each case
+# renders a scene and then one edit in batch mode, and compares the edited
+# frame with a plain render of the scene with the same change made to its
+# file. The last case moves a light far enough out to change the shadow ray
+# epsilon, which must not leave shadows found with the old one behind.
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+count=0
+while IFS='|' read -r scene old new edit; do
+    sed "s/\"position\": \[$old\]/\"position\": [$new]/" "$scene" > "$work/edited.json"
+    printf '%s\n%s\n' "$scene" "$edit" > "$work/script.txt"
+    for raycast in ./raycast ./raycast-float; do
+        count=$((count + 1))
+        rm -f "$work"/frame*.ppm "$work/fresh.ppm"
+        if ! $raycast batch --threads 2 200 150 "$scene" "$work/script.txt" "$work/frame%d.ppm" ||
+            ! $raycast --threads 2 200 150 "$work/edited.json" "$work/fresh.ppm"; then
+            echo "FAIL $raycast $edit: raycast exited with an error"
+            failed=$((failed + 1))
+            continue
+        fi
+        if result=$(tests/ppmdiff "$work/fresh.ppm" "$work/frame1.ppm" 0 0); then
+            echo "ok   $raycast $edit: $result"
+        else
+            echo "FAIL $raycast $edit: $result"
+            failed=$((failed + 1))
+        fi
+    done
+done <<CASES
+tests/scenes/spheres.json|2, 3, 0|2, 3.5, -1|light 0 2 3.5 -1
+tests/scenes/spheres.json|0.9, 0.4, 5|0.6, 0.2, 4.5|sphere 1 0.6 0.2 4.5
+tests/scenes/spheres.json|0.2, -0.8, 4|0.2, -0.8, 60|sphere 2 0.2 -0.8 60
+tests/scenes/lights.json|0, 1.5, -2|0, 1.5, -100000|light 3 0 1.5 -100000
+CASES
+echo "$((count - failed)) of $count passed"
+[ $failed = 0 ]
@@ -0,0 +1,103 @@
+//ppmdiff [--edges] golden.ppm image.ppm tolerance outliers
+//Compares two binary PPMs channel by channel. Prints the largest difference
+//and how many channels are further apart than tolerance, and exits with 1
+//if more than outliers percent of them are or the images do not have the
+//same size. With --edges a pixel that is off is forgiven when it matches one
+//of the eight pixels around it in golden to within tolerance, so a
+//silhouette or shadow edge may move by one pixel but nothing else may change.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//reads a P6 file with a maxval of 255; returns the pixels or NULL
+static unsigned char* read_ppm(char* filename, int* width, int* height) {
+    FILE* in = fopen(filename, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+        return NULL;
+    }
+    int maxval;
+    if (fscanf(in, "P6 %d %d %d", width, height, &maxval) != 3 || maxval != 255 || fgetc(in) == EOF) {
+        fprintf(stderr, "Error: \"%s\" is not an 8-bit binary PPM.\n", filename);
+        fclose(in);
+        return NULL;
+    }
+    size_t size = (size_t)*width * *height * 3;
+    unsigned char* pixels = malloc(size);
+    if (pixels == NULL || fread(pixels, 1, size, in) != size) {
+        fprintf(stderr, "Error: \"%s\" is truncated.\n", filename);
+        free(pixels);
+        fclose(in);
+        return NULL;
+    }
+    fclose(in);
+    return pixels;
+}
+
+//whether pixel i of image is within tolerance of pixel j of golden in every channel
+static int same_pixel(unsigned char* golden, long j, unsigned char* image, long i, int tolerance) {
+    for (int c = 0; c < 3; c += 1) {
+        if (abs(golden[j * 3 + c] - image[i * 3 + c]) > tolerance) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//whether pixel (x, y) of image matches one of its eight neighbours in golden
+static int moved_edge(unsigned char* golden, unsigned char* image, int width, int height, int x, int y, int tolerance) {
+    for (int dy = -1; dy <= 1; dy += 1) {
+        for (int dx = -1; dx <= 1; dx += 1) {
+            int nx = x + dx;
+            int ny = y + dy;
+            if ((dx != 0 || dy != 0) && nx >= 0 && nx < width && ny >= 0 && ny < height &&
+                same_pixel(golden, (long)ny * width + nx, image, (long)y * width + x, tolerance)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int edges = argc > 1 && strcmp(argv[1], "--edges") == 0;
+    argv += edges;
+    argc -= edges;
+    if (argc != 5) {
+        fprintf(stderr, "Please put the commands in the following format: [--edges] golden image, rendered image, tolerance, outlier percent.");
+        return 1;
+    }
+    int tolerance = atoi(argv[3]);
+    double outliers = atof(argv[4]);
+    int w0, h0, w1, h1;
+    unsigned char* golden = read_ppm(argv[1], &w0, &h0);
+    unsigned char* image = read_ppm(argv[2], &w1, &h1);
+    if (golden == NULL || image == NULL) {
+        return 1;
+    }
+    if (w0 != w1 || h0 != h1) {
+        printf("size %dx%d, expected %dx%d\n", w1, h1, w0, h0);
+        return 1;
+    }
+    int worst = 0;
+    long over = 0;
+    long moved = 0;
+    for (long i = 0; i < (long)w0 * h0 * 3; i += 1) {
+        int d = abs(golden[i] - image[i]);
+        if (d > tolerance && edges && moved_edge(golden, image, w0, h0, (int)(i / 3 % w0), (int)(i / 3 / w0), tolerance)) {
+            moved += 1;
+            continue;
+        }
+        worst = d > worst ? d : worst;
+        over += d > tolerance;
+    }
+    long channels = (long)w0 * h0 * 3;
+    if (edges) {
+        printf("max difference %d, %ld channels over %d, %ld on moved edges\n", worst, over, tolerance, moved);
+    } else {
+        printf("max difference %d, %ld channels over %d\n", worst, over, tolerance);
+    }
+    free(golden);
+    free(image);
+    return over > channels * outliers / 100;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Renders every line of tests/suite.txt with the double and the float build
+# and compares the two images. Every channel of the float render must be
+# within TOLERANCE of the double one; the only exception is a pixel that
+# matches a neighbour of the double render, where float roundoff moved a
+# silhouette or shadow edge by one pixel. With --spp N one of a pixel's N
+# samples can cross such an edge, so those lines allow 255 / N more. The
+# suite's outlier allowances do not apply here.
+cd "$(dirname "$0")/.." || exit 1
+TOLERANCE=2
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+count=0
+while read -r golden scene width height tolerance outliers seconds krays options; do
+    case "$golden" in
+        ''|'#'*) continue ;;
+    esac
+    count=$((count + 1))
+    spp=$(echo " $options " | sed -n 's/.* --spp \([0-9]*\) .*/\1/p')
+    limit=$TOLERANCE
+    if [ -n "$spp" ]; then
+        limit=$((TOLERANCE + (255 + spp - 1) / spp))
+    fi
+    rm -f "$work/double.ppm" "$work/float.ppm"
+    # shellcheck disable=SC2086
+    if ! ./raycast $options "$width" "$height" "$scene" "$work/double.ppm" ||
+        ! ./raycast-float $options "$width" "$height" "$scene" "$work/float.ppm"; then
+        echo "FAIL $golden${options:+ $options}: raycast exited with an error"
+        failed=$((failed + 1))
+        continue
+    fi
+    if result=$(tests/ppmdiff --edges "$work/double.ppm" "$work/float.ppm" $limit 0); then
+        echo "ok   $golden${options:+ $options}: $result"
+    else
+        echo "FAIL $golden${options:+ $options}: $result"
+        failed=$((failed + 1))
+    fi
+done < tests/suite.txt
+echo "$((count - failed)) of $count match in float"
+[ $failed = 0 ]
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Renders every line of tests/suite.txt and checks it against its golden
+# image and its time and speed budgets. With --update the goldens are
+# rewritten from the current renderer instead. BUDGET_SCALE stretches the
+# time budgets and shrinks the speed ones, for slow or busy machines.
+cd "$(dirname "$0")/.." || exit 1
+update=0
+if [ "$1" = "--update" ]; then
+    update=1
+fi
+scale=${BUDGET_SCALE:-1}
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+count=0
+while read -r golden scene width height tolerance outliers seconds krays options; do
+    case "$golden" in
+        ''|'#'*) continue ;;
+    esac
+    count=$((count + 1))
+    spp=$(echo " $options " | sed -n 's/.* --spp \([0-9]*\) .*/\1/p')
+    output="$work/$golden.ppm"
+    rm -f "$output"
+    start=$(date +%s%N)
+    # shellcheck disable=SC2086
+    if ! ./raycast $options "$width" "$height" "$scene" "$output"; then
+        echo "FAIL $golden${options:+ $options}: raycast exited with an error"
+        failed=$((failed + 1))
+        continue
+    fi
+    end=$(date +%s%N)
+    if [ $update = 1 ]; then
+        cp "$output" "tests/golden/$golden.ppm"
+        echo "updated $golden"
+        continue
+    fi
+    result=$(tests/ppmdiff "tests/golden/$golden.ppm" "$output" "$tolerance" "$outliers")
+    status=$?
+    speed=$(awk -v ns=$((end - start)) -v w="$width" -v h="$height" -v spp="${spp:-1}" \
+        -v seconds="$seconds" -v krays="$krays" -v scale="$scale" 'BEGIN {
+            s = ns / 1e9
+            rate = w * h * spp / s / 1e3
+            printf "%.3fs %.0f krays/s", s, rate
+            if (s > seconds * scale) printf ", over the %gs budget", seconds * scale
+            if (rate < krays / scale) printf ", under the %g krays/s budget", krays / scale
+        }')
+    case "$speed" in
+        *budget*) status=1 ;;
+    esac
+    if [ $status = 0 ]; then
+        echo "ok   $golden${options:+ $options}: $result; $speed"
+    else
+        echo "FAIL $golden${options:+ $options}: $result; $speed"
+        failed=$((failed + 1))
+    fi
+done < tests/suite.txt
+if [ $update = 0 ]; then
+    echo "$((count - failed)) of $count passed"
+fi
+[ $failed = 0 ]